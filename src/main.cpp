@@ -6,7 +6,28 @@
 #include <limits>
 #include <chrono>
 #include <fstream> 
+#include <iomanip>
 #include <filesystem>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <stdexcept>
+#include <zlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define cimg_display 0
 #include "CImg-3.5.4_pre04072515/CImg.h"
@@ -18,350 +39,2775 @@ struct RGB {
     double r = 0.0, g = 0.0, b = 0.0;
 };
 
+// Block errors are fixed point with kErrorFractionBits fractional bits. Every
+// metric derives its error from integer statistics, so the split decision is
+// an integer comparison that does not depend on the compiler or its
+// floating-point code generation.
+using FixedError = int64_t;
+constexpr int kErrorFractionBits = 32;
+
+// ceil(numerator / denominator) in error units; numerator must be < 2^96.
+// Errors round up, like thresholds, so a block whose exact error equals
+// the threshold never drops below it.
+FixedError fixedRatio(unsigned __int128 numerator, unsigned __int128 denominator) {
+    if (denominator == 0) return 0;
+    unsigned __int128 scaled = numerator << kErrorFractionBits;
+    unsigned __int128 quotient = scaled / denominator;
+    if (quotient * denominator != scaled) ++quotient;
+    return static_cast<FixedError>(quotient);
+}
+
+// Smallest fixed-point value not below the threshold. With errors rounded
+// up as well, fixed error < the returned value exactly when error <
+// threshold, except for an error less than 2^-32 below the threshold: it
+// rounds onto the same step and splits like a tie, as it would have (at
+// double precision) with the old floating-point comparison.
+FixedError thresholdToFixed(double threshold) {
+    double scaled = std::ceil(std::ldexp(threshold, kErrorFractionBits));
+    if (scaled >= std::ldexp(1.0, 63)) return numeric_limits<FixedError>::max();
+    return static_cast<FixedError>(scaled);
+}
+
+// The threshold a fixed-point value stands for; exact below 2^53.
+double fixedToThreshold(FixedError threshold) {
+    return std::ldexp(static_cast<double>(threshold), -kErrorFractionBits);
+}
+
+// Per-channel pixel count, sum and sum of squares of a block.
+struct BlockMoments {
+    uint64_t count = 0;
+    uint64_t sum[3] = {0, 0, 0};
+    uint64_t sumSq[3] = {0, 0, 0};
+
+    void merge(const BlockMoments& other) {
+        count += other.count;
+        for (int c = 0; c < 3; ++c) {
+            sum[c] += other.sum[c];
+            sumSq[c] += other.sumSq[c];
+        }
+    }
+
+    RGB mean() const {
+        RGB avg = {};
+        if (count == 0) return avg;
+        double numPixels = static_cast<double>(count);
+        avg.r = sum[0] / numPixels;
+        avg.g = sum[1] / numPixels;
+        avg.b = sum[2] / numPixels;
+        return avg;
+    }
+
+    // n^2 times the channel variance, n * sumSq - sum^2, computed exactly.
+    unsigned __int128 varianceNumerator(int c) const {
+        return static_cast<unsigned __int128>(count) * sumSq[c] -
+               static_cast<unsigned __int128>(sum[c]) * sum[c];
+    }
+
+    // Mean of the three channel variances.
+    FixedError variance() const {
+        if (count <= 1) return 0;
+        unsigned __int128 total = 0;
+        for (int c = 0; c < 3; ++c) {
+            total += varianceNumerator(c);
+        }
+        return fixedRatio(total, static_cast<unsigned __int128>(count) * count * 3);
+    }
+};
+
+// Per-channel minimum, maximum and sum of a block. Ranges of neighbouring
+// blocks merge into the range of their union.
+struct BlockRange {
+    uint64_t count = 0;
+    uint64_t sum[3] = {0, 0, 0};
+    unsigned char minV[3] = {255, 255, 255};
+    unsigned char maxV[3] = {0, 0, 0};
+
+    void merge(const BlockRange& other) {
+        count += other.count;
+        for (int c = 0; c < 3; ++c) {
+            sum[c] += other.sum[c];
+            minV[c] = min(minV[c], other.minV[c]);
+            maxV[c] = max(maxV[c], other.maxV[c]);
+        }
+    }
+
+    RGB mean() const {
+        RGB avg = {};
+        if (count == 0) return avg;
+        double numPixels = static_cast<double>(count);
+        avg.r = sum[0] / numPixels;
+        avg.g = sum[1] / numPixels;
+        avg.b = sum[2] / numPixels;
+        return avg;
+    }
+
+    FixedError maxDiff() const {
+        if (count == 0) return 0;
+        unsigned rangeSum = 0;
+        for (int c = 0; c < 3; ++c) {
+            rangeSum += maxV[c] - minV[c];
+        }
+        return fixedRatio(rangeSum, 3);
+    }
+};
+
+// Compact node: the block's colour as drawn and the index of its first
+// child. Geometry is implicit, since a child's block follows from its
+// parent's block and its quadrant, and is recomputed while walking down from
+// the root.
 class QuadtreeNode {
 public:
+    static constexpr uint32_t kNoChildren = UINT32_MAX;
+
+    unsigned char color[3] = {0, 0, 0};
+
+    // A split node always has all four children, stored next to each other
+    // in the arena as NW, NE, SW, SE starting at firstChild.
+    uint32_t firstChild = kNoChildren;
+
+    bool isLeaf() const {
+        return firstChild == kNoChildren;
+    }
+
+    // Average colour quantized the way it is drawn: clamped and truncated.
+    void setColor(const RGB& avg) {
+        color[0] = static_cast<unsigned char>(max(0.0, min(255.0, avg.r)));
+        color[1] = static_cast<unsigned char>(max(0.0, min(255.0, avg.g)));
+        color[2] = static_cast<unsigned char>(max(0.0, min(255.0, avg.b)));
+    }
+};
+
+static_assert(sizeof(QuadtreeNode) == 8, "QuadtreeNode should stay compact");
+
+// Node storage addressed by 32-bit indices. Nodes live in fixed-size chunks
+// that never move, so a reference to a node stays valid while the tree
+// grows. Every builder thread bumps through a chunk of its own (a Cursor)
+// and only takes the lock to fetch a fresh chunk. Destroying the arena
+// releases the chunks without visiting any node.
+class QuadtreeArena {
+public:
+    static constexpr uint32_t kChunkBits = 16;
+    static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+    static constexpr uint32_t kMaxChunks = 1u << (32 - kChunkBits);
+
+    struct Cursor {
+        uint32_t next = 0, end = 0;
+    };
+
+    QuadtreeArena() : chunks(make_unique<unique_ptr<QuadtreeNode[]>[]>(kMaxChunks)) {}
+
+    QuadtreeNode& operator[](uint32_t index) {
+        return chunks[index >> kChunkBits][index & (kChunkSize - 1)];
+    }
+
+    const QuadtreeNode& operator[](uint32_t index) const {
+        return chunks[index >> kChunkBits][index & (kChunkSize - 1)];
+    }
+
+    // Index of the first of count adjacent nodes.
+    uint32_t allocate(Cursor& cursor, uint32_t count) {
+        if (cursor.end - cursor.next < count) {
+            cursor.next = newChunk();
+            cursor.end = cursor.next + kChunkSize;
+        }
+        uint32_t index = cursor.next;
+        cursor.next += count;
+        return index;
+    }
+
+private:
+    uint32_t newChunk() {
+        lock_guard<mutex> guard(chunkLock);
+        // The last chunk is never handed out, so kNoChildren is not an index.
+        if (chunkCount + 1 >= kMaxChunks) {
+            throw runtime_error("Pohon terlalu besar untuk indeks simpul 32-bit.");
+        }
+        chunks[chunkCount] = make_unique<QuadtreeNode[]>(kChunkSize);
+        return (chunkCount++) << kChunkBits;
+    }
+
+    unique_ptr<unique_ptr<QuadtreeNode[]>[]> chunks;
+    uint32_t chunkCount = 0;
+    mutex chunkLock;
+};
+
+
+void printWarning(string message) {
+    cout << "\033[1;31m  !! " << message << "\033[0m\n";
+}
+
+void printCommand(string message) {
+    cout << "\n\033[2m╭────\033[0m" << message << "\n\033[2m╰─\033[0;32m❯❯ \033[0m";
+}
+
+void printLine(string message) {
+    cout << "\033[1;32m  ▓╟ " << message << "\033[0m\n";
+}
+
+void clearCinBuffer() {
+    cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+}
+
+long long getFileSizeStream(const std::string& filepath) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    std::streampos size = file.tellg();
+    file.close();
+    return static_cast<long long>(size);
+}
+
+// Size in bytes of the PNG libpng writes for an 8-bit RGB image with the
+// settings CImg leaves at their defaults: each row gets the filter with the
+// smallest sum of bytes taken as signed, the rows go through zlib level 6
+// with Z_FILTERED, and IDAT chunks hold at most 8 KiB. The deflate output is
+// written over one small buffer and only counted, so nothing touches disk.
+long long estimatePngSize(const CImg<unsigned char>& image) {
+    const int width = image.width(), height = image.height();
+    const size_t rowBytes = static_cast<size_t>(width) * 3;
+    constexpr int bpp = 3;
+
+    z_stream stream{};
+    if (deflateInit2(&stream, 6, Z_DEFLATED, 15, 8, Z_FILTERED) != Z_OK) {
+        throw runtime_error("deflateInit2 gagal");
+    }
+    unsigned char sink[16384];
+    long long compressed = 0;
+    auto pump = [&](const unsigned char* data, size_t size, int flush) {
+        stream.next_in = const_cast<unsigned char*>(data);
+        stream.avail_in = static_cast<uInt>(size);
+        int status;
+        do {
+            stream.next_out = sink;
+            stream.avail_out = sizeof(sink);
+            status = deflate(&stream, flush);
+            compressed += static_cast<long long>(sizeof(sink) - stream.avail_out);
+        } while (stream.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    };
+
+    // Five candidate rows (None, Sub, Up, Average, Paeth), each led by its
+    // filter type byte; the previous row starts out as zeros.
+    vector<unsigned char> previous(rowBytes, 0), current(rowBytes);
+    vector<unsigned char> filtered[5];
+    for (int f = 0; f < 5; ++f) {
+        filtered[f].assign(rowBytes + 1, static_cast<unsigned char>(f));
+    }
+    auto signedSum = [&](const vector<unsigned char>& row) {
+        size_t sum = 0;
+        for (size_t i = 1; i <= rowBytes; ++i) {
+            int v = row[i];
+            sum += v < 128 ? v : 256 - v;
+        }
+        return sum;
+    };
+
+    for (int y = 0; y < height; ++y) {
+        for (int c = 0; c < 3; ++c) {
+            const unsigned char* channel = image.data(0, y, 0, c);
+            for (int x = 0; x < width; ++x) {
+                current[static_cast<size_t>(x) * 3 + c] = channel[x];
+            }
+        }
+        // A row equal to the one above (most rows of a reconstruction) is all
+        // zeros under Up, which wins unless the row is black and None ties.
+        if (y > 0 && equal(current.begin(), current.end(), previous.begin())) {
+            bool black = all_of(current.begin(), current.end(), [](unsigned char v) { return v == 0; });
+            vector<unsigned char>& row = filtered[black ? 0 : 2];
+            fill(row.begin() + 1, row.end(), 0);
+            pump(row.data(), rowBytes + 1, Z_NO_FLUSH);
+            continue;
+        }
+        for (size_t i = 0; i < rowBytes; ++i) {
+            int a = i >= bpp ? current[i - bpp] : 0;
+            int b = previous[i];
+            int d = i >= bpp ? previous[i - bpp] : 0;
+            int p = a + b - d;
+            int pa = abs(p - a), pb = abs(p - b), pd = abs(p - d);
+            int paeth = (pa <= pb && pa <= pd) ? a : (pb <= pd ? b : d);
+            filtered[0][i + 1] = current[i];
+            filtered[1][i + 1] = static_cast<unsigned char>(current[i] - a);
+            filtered[2][i + 1] = static_cast<unsigned char>(current[i] - b);
+            filtered[3][i + 1] = static_cast<unsigned char>(current[i] - (a + b) / 2);
+            filtered[4][i + 1] = static_cast<unsigned char>(current[i] - paeth);
+        }
+        // libpng keeps the first filter on ties.
+        int best = 0;
+        size_t bestSum = signedSum(filtered[0]);
+        for (int f = 1; f < 5; ++f) {
+            size_t sum = signedSum(filtered[f]);
+            if (sum < bestSum) {
+                best = f;
+                bestSum = sum;
+            }
+        }
+        pump(filtered[best].data(), rowBytes + 1, Z_NO_FLUSH);
+        swap(previous, current);
+    }
+    pump(nullptr, 0, Z_FINISH);
+    deflateEnd(&stream);
+
+    // Signature, IHDR and IEND, plus 12 bytes of framing per IDAT chunk.
+    constexpr long long kIdatChunk = 8192;
+    return 8 + 25 + 12 + compressed + 12 * ((compressed + kIdatChunk - 1) / kIdatChunk);
+}
+
+// Prints an in-memory size estimate next to its error against the saved file.
+void printEstimate(long long estimatedSize, long long savedSize, double milliseconds) {
+    printLine("Estimasi ukuran        : " + to_string(estimatedSize) + " bytes (" + to_string(milliseconds) + " ms)");
+    if (savedSize > 0) {
+        long long difference = estimatedSize - savedSize;
+        printLine("Selisih estimasi       : " + to_string(difference) + " bytes (" +
+                  to_string(100.0 * static_cast<double>(difference) / static_cast<double>(savedSize)) + " %)");
+    }
+}
+
+
+// Average color and error of a block, produced together by one kernel.
+struct BlockResult {
     RGB avgColor;
-    int x, y, width, height;
-    bool isLeaf = false;
+    FixedError error = 0;
+};
+
+// Per-channel histograms reused from node to node. Only the bins touched by
+// the current block are cleared again, so small blocks don't pay for 768.
+struct BlockHistogram {
+    uint32_t count[3][256] = {};
+    unsigned char used[3][256] = {};
+    int numUsed[3] = {0, 0, 0};
+    uint64_t channelSum[3] = {0, 0, 0};
+    uint64_t numPixels = 0;
+
+    void fill(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+        numPixels += static_cast<uint64_t>(width) * height;
+        if (static_cast<long long>(width) * height >= kLaneArea) {
+            fillLanes(image, x, y, width, height);
+            return;
+        }
+        for (int c = 0; c < 3; ++c) {
+            for (int j = y; j < y + height; ++j) {
+                const unsigned char* row = image.data(x, j, 0, c);
+                uint32_t rowSum = 0;
+                for (int i = 0; i < width; ++i) {
+                    unsigned char v = row[i];
+                    rowSum += v;
+                    if (count[c][v]++ == 0) {
+                        used[c][numUsed[c]++] = v;
+                    }
+                }
+                channelSum[c] += rowSum;
+            }
+        }
+    }
+
+    // Large blocks count into four interleaved lanes first. In flat regions
+    // every pixel hits the same bin, and with one counter each increment
+    // would have to wait for the previous one.
+    static constexpr long long kLaneArea = 16384;
+
+    void fillLanes(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+        for (int c = 0; c < 3; ++c) {
+            uint32_t lanes[4][256] = {};
+            for (int j = y; j < y + height; ++j) {
+                const unsigned char* row = image.data(x, j, 0, c);
+                uint32_t rowSum = 0;
+                int i = 0;
+                for (; i + 4 <= width; i += 4) {
+                    lanes[0][row[i]]++;
+                    lanes[1][row[i + 1]]++;
+                    lanes[2][row[i + 2]]++;
+                    lanes[3][row[i + 3]]++;
+                    rowSum += row[i] + row[i + 1] + row[i + 2] + row[i + 3];
+                }
+                for (; i < width; ++i) {
+                    lanes[0][row[i]]++;
+                    rowSum += row[i];
+                }
+                channelSum[c] += rowSum;
+            }
+            for (int v = 0; v < 256; ++v) {
+                uint32_t n = lanes[0][v] + lanes[1][v] + lanes[2][v] + lanes[3][v];
+                if (n == 0) continue;
+                if (count[c][v] == 0) {
+                    used[c][numUsed[c]++] = static_cast<unsigned char>(v);
+                }
+                count[c][v] += n;
+            }
+        }
+    }
+
+    // Adds another histogram, visiting only the bins it actually uses.
+    void merge(const BlockHistogram& other) {
+        for (int c = 0; c < 3; ++c) {
+            for (int k = 0; k < other.numUsed[c]; ++k) {
+                unsigned char v = other.used[c][k];
+                if (count[c][v] == 0) {
+                    used[c][numUsed[c]++] = v;
+                }
+                count[c][v] += other.count[c][v];
+            }
+            channelSum[c] += other.channelSum[c];
+        }
+        numPixels += other.numPixels;
+    }
+
+    RGB mean() const {
+        RGB avg = {};
+        if (numPixels == 0) return avg;
+        double n = static_cast<double>(numPixels);
+        avg.r = sum(0) / n;
+        avg.g = sum(1) / n;
+        avg.b = sum(2) / n;
+        return avg;
+    }
+
+    uint64_t sum(int c) const {
+        return channelSum[c];
+    }
+
+    void clear() {
+        for (int c = 0; c < 3; ++c) {
+            for (int k = 0; k < numUsed[c]; ++k) {
+                count[c][used[c][k]] = 0;
+            }
+            numUsed[c] = 0;
+            channelSum[c] = 0;
+        }
+        numPixels = 0;
+    }
+};
+
+// Pixel kernels over one channel of a block, walking rows by the image
+// stride. The SIMD variants sum bytes with SAD against zero and square them
+// by widening to 16-bit lanes and multiply-adding into 32-bit lanes; min/max
+// run on the bytes directly. Lane totals are reduced once per block, and the
+// squared lanes are flushed every kFlushPixels so they cannot overflow.
+//
+// Every variant the CPU supports is detected once at startup. A block goes to
+// the widest one whose vector still fits in a row; narrower blocks stay on the
+// scalar loop.
+struct PixelKernel {
+    int lanes;
+    void (*moments)(const unsigned char* data, int stride, int width, int height,
+                    uint64_t& sum, uint64_t& sumSq);
+    void (*range)(const unsigned char* data, int stride, int width, int height,
+                  uint64_t& sum, unsigned char& minV, unsigned char& maxV);
+    const char* name;
+};
+
+constexpr int kFlushPixels = 65536; // 65536 / 4 * 255^2 < 2^32 per 32-bit lane
+
+void blockMomentsScalar(const unsigned char* data, int stride, int width, int height,
+                        uint64_t& sum, uint64_t& sumSq) {
+    for (int j = 0; j < height; ++j, data += stride) {
+        uint64_t rowSum = 0, rowSumSq = 0;
+        for (int i = 0; i < width; ++i) {
+            uint32_t v = data[i];
+            rowSum += v;
+            rowSumSq += v * v;
+        }
+        sum += rowSum;
+        sumSq += rowSumSq;
+    }
+}
+
+void blockRangeScalar(const unsigned char* data, int stride, int width, int height,
+                      uint64_t& sum, unsigned char& minV, unsigned char& maxV) {
+    for (int j = 0; j < height; ++j, data += stride) {
+        uint64_t rowSum = 0;
+        for (int i = 0; i < width; ++i) {
+            unsigned char v = data[i];
+            rowSum += v;
+            if (v < minV) minV = v;
+            if (v > maxV) maxV = v;
+        }
+        sum += rowSum;
+    }
+}
+
+#if defined(__x86_64__)
+template <int N>
+void foldLanes(const unsigned char* lo, const unsigned char* hi, unsigned char& minV, unsigned char& maxV) {
+    for (int k = 0; k < N; ++k) {
+        if (lo[k] < minV) minV = lo[k];
+        if (hi[k] > maxV) maxV = hi[k];
+    }
+}
+
+__attribute__((target("sse4.1")))
+void blockMomentsSSE41(const unsigned char* data, int stride, int width, int height,
+                       uint64_t& sum, uint64_t& sumSq) {
+    const __m128i zero = _mm_setzero_si128();
+    const int vectorWidth = width & ~15;
+    __m128i accSum = zero, accSq = zero;
+    alignas(16) uint32_t squares[4];
+    int pending = 0;
+    for (int j = 0; j < height; ++j, data += stride) {
+        if (pending + vectorWidth > kFlushPixels) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(squares), accSq);
+            sumSq += static_cast<uint64_t>(squares[0]) + squares[1] + squares[2] + squares[3];
+            accSq = zero;
+            pending = 0;
+        }
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            accSum = _mm_add_epi64(accSum, _mm_sad_epu8(v, zero));
+            __m128i lo = _mm_cvtepu8_epi16(v);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            accSq = _mm_add_epi32(accSq, _mm_madd_epi16(lo, lo));
+            accSq = _mm_add_epi32(accSq, _mm_madd_epi16(hi, hi));
+        }
+        pending += vectorWidth;
+        blockMomentsScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, sumSq);
+    }
+    alignas(16) uint64_t sums[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(sums), accSum);
+    _mm_store_si128(reinterpret_cast<__m128i*>(squares), accSq);
+    sum += sums[0] + sums[1];
+    sumSq += static_cast<uint64_t>(squares[0]) + squares[1] + squares[2] + squares[3];
+}
+
+__attribute__((target("sse4.1")))
+void blockRangeSSE41(const unsigned char* data, int stride, int width, int height,
+                     uint64_t& sum, unsigned char& minV, unsigned char& maxV) {
+    const __m128i zero = _mm_setzero_si128();
+    const int vectorWidth = width & ~15;
+    __m128i accSum = zero;
+    __m128i lo = _mm_set1_epi8(static_cast<char>(minV));
+    __m128i hi = _mm_set1_epi8(static_cast<char>(maxV));
+    for (int j = 0; j < height; ++j, data += stride) {
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            accSum = _mm_add_epi64(accSum, _mm_sad_epu8(v, zero));
+            lo = _mm_min_epu8(lo, v);
+            hi = _mm_max_epu8(hi, v);
+        }
+        blockRangeScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, minV, maxV);
+    }
+    alignas(16) uint64_t sums[2];
+    alignas(16) unsigned char lanesLo[16], lanesHi[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(sums), accSum);
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanesLo), lo);
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanesHi), hi);
+    sum += sums[0] + sums[1];
+    foldLanes<16>(lanesLo, lanesHi, minV, maxV);
+}
+
+__attribute__((target("avx2")))
+void blockMomentsAVX2(const unsigned char* data, int stride, int width, int height,
+                      uint64_t& sum, uint64_t& sumSq) {
+    const __m256i zero = _mm256_setzero_si256();
+    const int vectorWidth = width & ~31;
+    __m256i accSum = zero, accSq = zero;
+    alignas(32) uint32_t squares[8];
+    int pending = 0;
+    for (int j = 0; j < height; ++j, data += stride) {
+        if (pending + vectorWidth > kFlushPixels) {
+            _mm256_store_si256(reinterpret_cast<__m256i*>(squares), accSq);
+            for (int k = 0; k < 8; ++k) sumSq += squares[k];
+            accSq = zero;
+            pending = 0;
+        }
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            accSum = _mm256_add_epi64(accSum, _mm256_sad_epu8(v, zero));
+            __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+            __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+            accSq = _mm256_add_epi32(accSq, _mm256_madd_epi16(lo, lo));
+            accSq = _mm256_add_epi32(accSq, _mm256_madd_epi16(hi, hi));
+        }
+        pending += vectorWidth;
+        blockMomentsScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, sumSq);
+    }
+    alignas(32) uint64_t sums[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(sums), accSum);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(squares), accSq);
+    for (int k = 0; k < 4; ++k) sum += sums[k];
+    for (int k = 0; k < 8; ++k) sumSq += squares[k];
+}
+
+__attribute__((target("avx2")))
+void blockRangeAVX2(const unsigned char* data, int stride, int width, int height,
+                    uint64_t& sum, unsigned char& minV, unsigned char& maxV) {
+    const __m256i zero = _mm256_setzero_si256();
+    const int vectorWidth = width & ~31;
+    __m256i accSum = zero;
+    __m256i lo = _mm256_set1_epi8(static_cast<char>(minV));
+    __m256i hi = _mm256_set1_epi8(static_cast<char>(maxV));
+    for (int j = 0; j < height; ++j, data += stride) {
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            accSum = _mm256_add_epi64(accSum, _mm256_sad_epu8(v, zero));
+            lo = _mm256_min_epu8(lo, v);
+            hi = _mm256_max_epu8(hi, v);
+        }
+        blockRangeScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, minV, maxV);
+    }
+    alignas(32) uint64_t sums[4];
+    alignas(32) unsigned char lanesLo[32], lanesHi[32];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(sums), accSum);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanesLo), lo);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanesHi), hi);
+    for (int k = 0; k < 4; ++k) sum += sums[k];
+    foldLanes<32>(lanesLo, lanesHi, minV, maxV);
+}
+
+// The 256-bit halves are loaded separately rather than extracted from the
+// 512-bit vector; GCC 12's extract intrinsics trip -Wuninitialized.
+__attribute__((target("avx512f,avx512bw")))
+void blockMomentsAVX512(const unsigned char* data, int stride, int width, int height,
+                        uint64_t& sum, uint64_t& sumSq) {
+    const __m512i zero = _mm512_setzero_si512();
+    const int vectorWidth = width & ~63;
+    __m512i accSum = zero, accSq = zero;
+    alignas(64) uint32_t squares[16];
+    int pending = 0;
+    for (int j = 0; j < height; ++j, data += stride) {
+        if (pending + vectorWidth > kFlushPixels) {
+            _mm512_store_si512(squares, accSq);
+            for (int k = 0; k < 16; ++k) sumSq += squares[k];
+            accSq = zero;
+            pending = 0;
+        }
+        for (int i = 0; i < vectorWidth; i += 64) {
+            __m512i v = _mm512_loadu_si512(data + i);
+            accSum = _mm512_add_epi64(accSum, _mm512_sad_epu8(v, zero));
+            __m512i lo = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+            __m512i hi = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32)));
+            accSq = _mm512_add_epi32(accSq, _mm512_madd_epi16(lo, lo));
+            accSq = _mm512_add_epi32(accSq, _mm512_madd_epi16(hi, hi));
+        }
+        pending += vectorWidth;
+        blockMomentsScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, sumSq);
+    }
+    alignas(64) uint64_t sums[8];
+    _mm512_store_si512(sums, accSum);
+    _mm512_store_si512(squares, accSq);
+    for (int k = 0; k < 8; ++k) sum += sums[k];
+    for (int k = 0; k < 16; ++k) sumSq += squares[k];
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void blockRangeAVX512(const unsigned char* data, int stride, int width, int height,
+                      uint64_t& sum, unsigned char& minV, unsigned char& maxV) {
+    const __m512i zero = _mm512_setzero_si512();
+    const int vectorWidth = width & ~63;
+    __m512i accSum = zero;
+    __m512i lo = _mm512_set1_epi8(static_cast<char>(minV));
+    __m512i hi = _mm512_set1_epi8(static_cast<char>(maxV));
+    for (int j = 0; j < height; ++j, data += stride) {
+        for (int i = 0; i < vectorWidth; i += 64) {
+            __m512i v = _mm512_loadu_si512(data + i);
+            accSum = _mm512_add_epi64(accSum, _mm512_sad_epu8(v, zero));
+            lo = _mm512_min_epu8(lo, v);
+            hi = _mm512_max_epu8(hi, v);
+        }
+        blockRangeScalar(data + vectorWidth, stride, width - vectorWidth, 1, sum, minV, maxV);
+    }
+    alignas(64) uint64_t sums[8];
+    alignas(64) unsigned char lanesLo[64], lanesHi[64];
+    _mm512_store_si512(sums, accSum);
+    _mm512_store_si512(lanesLo, lo);
+    _mm512_store_si512(lanesHi, hi);
+    for (int k = 0; k < 8; ++k) sum += sums[k];
+    foldLanes<64>(lanesLo, lanesHi, minV, maxV);
+}
+#endif
+
+class PixelKernels {
+public:
+    PixelKernels() {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+            add({64, blockMomentsAVX512, blockRangeAVX512, "avx512"});
+        if (__builtin_cpu_supports("avx2"))
+            add({32, blockMomentsAVX2, blockRangeAVX2, "avx2"});
+        if (__builtin_cpu_supports("sse4.1"))
+            add({16, blockMomentsSSE41, blockRangeSSE41, "sse4.1"});
+#endif
+        add({1, blockMomentsScalar, blockRangeScalar, "scalar"});
+    }
+
+    // Widest supported variant, widest first.
+    const char* name() const {
+        return kernels[0].name;
+    }
+
+    // Rows wider than kFlushPixels could overflow the squared lanes before
+    // the next flush, so they take the scalar loop.
+    const PixelKernel& forWidth(int width) const {
+        if (width > kFlushPixels) return kernels[count - 1];
+        int k = 0;
+        while (kernels[k].lanes > width) ++k;
+        return kernels[k];
+    }
+
+private:
+    void add(const PixelKernel& kernel) {
+        kernels[count++] = kernel;
+    }
+
+    PixelKernel kernels[4];
+    int count = 0;
+};
+
+const PixelKernels pixelKernels;
+
+BlockMoments scanBlockMoments(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    BlockMoments m;
+    if (width <= 0 || height <= 0) return m;
+    m.count = static_cast<uint64_t>(width) * height;
+    const PixelKernel& kernel = pixelKernels.forWidth(width);
+    for (int c = 0; c < 3; ++c)
+        kernel.moments(image.data(x, y, 0, c), image.width(), width, height, m.sum[c], m.sumSq[c]);
+    return m;
+}
+
+// Quadtree split points along one axis. Every depth halves the intervals of
+// the previous one exactly like buildQuadtree does (w / 2, then the rest);
+// intervals of length 1 are carried over unchanged.
+struct SplitAxis {
+    vector<vector<int>> starts;  // interval starts per depth
+    vector<int> longest;         // longest interval per depth
+    vector<vector<int>> indexOf; // interval index per depth, keyed by its start
+
+    void build(int length) {
+        starts.assign(1, vector<int>{0});
+        longest.assign(1, length);
+        while (longest.back() >= 2) {
+            const vector<int>& parent = starts.back();
+            vector<int> next;
+            int nextLongest = 0;
+            for (size_t i = 0; i < parent.size(); ++i) {
+                int start = parent[i];
+                int end = (i + 1 < parent.size()) ? parent[i + 1] : length;
+                int half = (end - start) / 2;
+                next.push_back(start);
+                if (half > 0) {
+                    next.push_back(start + half);
+                }
+                nextLongest = max(nextLongest, max(half, end - start - half));
+            }
+            starts.push_back(move(next));
+            longest.push_back(nextLongest);
+        }
+
+        indexOf.assign(starts.size(), vector<int>(length + 1, -1));
+        for (size_t d = 0; d < starts.size(); ++d) {
+            for (size_t i = 0; i < starts[d].size(); ++i) {
+                indexOf[d][starts[d][i]] = static_cast<int>(i);
+            }
+        }
+    }
+};
+
+// Fixed set of workers, each with its own task deque. A worker pops its
+// newest task first and, when it runs dry, steals the oldest task of
+// another worker, so large subtrees spread out early while small ones stay
+// local. The thread that owns the pool is worker 0 and runs tasks in wait().
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threadCount) : queues(threadCount) {
+        for (int i = 1; i < threadCount; ++i) {
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(queues.size());
+    }
+
+    static int currentWorker() {
+        return workerId;
+    }
+
+    void submit(function<void()> task) {
+        pending.fetch_add(1, memory_order_relaxed);
+        Queue& queue = queues[workerId];
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    // Returns once every submitted task, including those submitted by other
+    // tasks, has finished.
+    void wait() {
+        while (pending.load(memory_order_acquire) > 0) {
+            if (!runOne(0)) this_thread::yield();
+        }
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    bool take(int index, bool newest, function<void()>& task) {
+        Queue& queue = queues[index];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) return false;
+        if (newest) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+
+    bool runOne(int self) {
+        function<void()> task;
+        bool found = take(self, true, task);
+        for (int k = 1; k < size() && !found; ++k) {
+            found = take((self + k) % size(), false, task);
+        }
+        if (!found) return false;
+        task();
+        pending.fetch_sub(1, memory_order_acq_rel);
+        return true;
+    }
+
+    void workerLoop(int self) {
+        workerId = self;
+        while (true) {
+            if (runOne(self)) continue;
+            unique_lock<mutex> guard(sleepLock);
+            if (stopping) return;
+            // Timed so a notify that raced with the empty check is not lost.
+            wake.wait_for(guard, chrono::milliseconds(1));
+        }
+    }
+
+    static inline thread_local int workerId = 0;
+    vector<Queue> queues;
+    vector<thread> workers;
+    atomic<long long> pending{0};
+    mutex sleepLock;
+    condition_variable wake;
+    bool stopping = false;
+};
+
+// Runs body(i) for every i in [0, count) on up to threadCount threads: an
+// OpenMP loop in the OpenMP build, tasks on a pool otherwise. The calling
+// thread takes part, so threadCount = 1 runs the loop in place.
+template <class Body>
+void parallelFor(int threadCount, long long count, const Body& body) {
+    if (threadCount <= 1 || count <= 1) {
+        for (long long i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threadCount) schedule(dynamic)
+    for (long long i = 0; i < count; ++i) {
+        body(i);
+    }
+#else
+    WorkStealingPool pool(static_cast<int>(min<long long>(threadCount, count)));
+    for (long long i = 1; i < count; ++i) {
+        pool.submit([&body, i] { body(i); });
+    }
+    body(0);
+    pool.wait();
+#endif
+}
+
+// Summed-area table of per-channel sums and sums of squares, sampled at the
+// quadtree's own split points instead of at every pixel. Each axis keeps
+// the split points of the deepest level whose intervals are still at least
+// kGridSpacing pixels long, so every block down to that size has its
+// corners on the grid and its moments come from four lookups. Smaller
+// blocks are scanned, which reads each of their pixels once per level
+// below the grid (three levels at most, from under 8 pixels a side down to 1).
+//
+// Entries are exact 64-bit totals. Intervals of one level differ by at most
+// a pixel, so grid cells span at least 7x7 pixels (e.g. nearly all of them
+// for a side of 897) and the table takes under 48 / 49 = 0.98 bytes per
+// pixel, a third of the image itself (under 98 MB at 100 megapixels).
+// Building it is a single scan of the image.
+class IntegralImage {
+public:
+    static constexpr int kGridSpacing = 8;
+
+    void build(const CImg<unsigned char>& image, int threadCount) {
+        columns = gridOf(image.width(), columnIndex);
+        rows = gridOf(image.height(), rowIndex);
+        stride = columns.size();
+        table.assign(stride * rows.size(), Entry{});
+
+        // Every cell's totals go to the entry at its bottom-right corner and
+        // are summed along the grid row; rows are independent, so each one is
+        // a task...
+        parallelFor(threadCount, static_cast<long long>(rows.size()) - 1, [&](long long r) {
+            Entry* row = &table[(r + 1) * stride];
+            for (size_t k = 0; k + 1 < columns.size(); ++k) {
+                BlockMoments cell = scanBlockMoments(image, columns[k], rows[r],
+                                                     columns[k + 1] - columns[k], rows[r + 1] - rows[r]);
+                Entry& entry = row[k + 1];
+                for (int c = 0; c < 3; ++c) {
+                    entry.sum[c] = cell.sum[c];
+                    entry.sumSq[c] = cell.sumSq[c];
+                }
+                entry.add(row[k]);
+            }
+        });
+        // ...then running totals down the columns, split into one band of
+        // columns per thread, turn them into the table.
+        const long long bands = min<long long>(max(1, threadCount), static_cast<long long>(stride));
+        parallelFor(threadCount, bands, [&](long long band) {
+            size_t begin = 1 + (stride - 1) * band / bands;
+            size_t end = 1 + (stride - 1) * (band + 1) / bands;
+            for (size_t r = 2; r < rows.size(); ++r) {
+                for (size_t k = begin; k < end; ++k) {
+                    table[r * stride + k].add(table[(r - 1) * stride + k]);
+                }
+            }
+        });
+    }
+
+    bool empty() const {
+        return table.empty();
+    }
+
+    // Moments of a block whose corners all lie on the grid. Returns false
+    // for any other block, which the caller scans instead.
+    bool query(int x, int y, int w, int h, BlockMoments& m) const {
+        int left = columnIndex[x], right = columnIndex[x + w];
+        int top = rowIndex[y], bottom = rowIndex[y + h];
+        if (left < 0 || right < 0 || top < 0 || bottom < 0) return false;
+
+        const Entry& a = table[top * stride + left];
+        const Entry& b = table[top * stride + right];
+        const Entry& c0 = table[bottom * stride + left];
+        const Entry& d = table[bottom * stride + right];
+        m.count = static_cast<uint64_t>(w) * h;
+        for (int c = 0; c < 3; ++c) {
+            m.sum[c] = d.sum[c] - b.sum[c] - c0.sum[c] + a.sum[c];
+            m.sumSq[c] = d.sumSq[c] - b.sumSq[c] - c0.sumSq[c] + a.sumSq[c];
+        }
+        return true;
+    }
+
+private:
+    struct Entry {
+        uint64_t sum[3] = {0, 0, 0};
+        uint64_t sumSq[3] = {0, 0, 0};
+
+        void add(const Entry& other) {
+            for (int c = 0; c < 3; ++c) {
+                sum[c] += other.sum[c];
+                sumSq[c] += other.sumSq[c];
+            }
+        }
+    };
+
+    // Split points of the deepest level with intervals of at least
+    // kGridSpacing, plus the far edge; index maps a coordinate to its grid
+    // position, or -1 if it is not on the grid.
+    static vector<int> gridOf(int length, vector<int>& index) {
+        SplitAxis axis;
+        axis.build(length);
+        size_t depth = 0;
+        while (depth + 1 < axis.starts.size() && axis.longest[depth + 1] >= kGridSpacing) {
+            ++depth;
+        }
+        vector<int> grid = axis.starts[depth];
+        grid.push_back(length);
+        index.assign(length + 1, -1);
+        for (size_t i = 0; i < grid.size(); ++i) {
+            index[grid[i]] = static_cast<int>(i);
+        }
+        return grid;
+    }
+
+    vector<int> columns, rows, columnIndex, rowIndex;
+    size_t stride = 0;
+    vector<Entry> table;
+};
+
+// Moments from the integral image where it covers the block, else a scan.
+BlockMoments blockMoments(const CImg<unsigned char>& image, const IntegralImage& integral,
+                          int x, int y, int width, int height) {
+    BlockMoments moments;
+    if (integral.empty() || !integral.query(x, y, width, height, moments)) {
+        moments = scanBlockMoments(image, x, y, width, height);
+    }
+    return moments;
+}
+
+BlockResult evaluateBlockVariance(const CImg<unsigned char>& image, const IntegralImage& integral,
+                                  int x, int y, int width, int height) {
+    BlockMoments moments = blockMoments(image, integral, x, y, width, height);
+    return {moments.mean(), moments.variance()};
+}
+
+BlockRange scanBlockRange(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    BlockRange range;
+    if (width <= 0 || height <= 0) return range;
+    range.count = static_cast<uint64_t>(width) * height;
+    const PixelKernel& kernel = pixelKernels.forWidth(width);
+    for (int c = 0; c < 3; ++c)
+        kernel.range(image.data(x, y, 0, c), image.width(), width, height,
+                     range.sum[c], range.minV[c], range.maxV[c]);
+    return range;
+}
+
+BlockResult evaluateBlockMaxDiff(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    BlockRange range = scanBlockRange(image, x, y, width, height);
+    return {range.mean(), range.maxDiff()};
+}
+
+// log2(x) in error units, by repeated squaring of the mantissa. Integer
+// arithmetic only, so the entropy table is identical on every platform.
+FixedError fixedLog2(uint64_t x) {
+    int whole = 63 - __builtin_clzll(x);
+    unsigned __int128 mantissa = (static_cast<unsigned __int128>(x) << 62) >> whole; // [1, 2) with 62 fraction bits
+    FixedError result = static_cast<FixedError>(whole) << kErrorFractionBits;
+    for (int bit = kErrorFractionBits - 1; bit >= 0; --bit) {
+        mantissa = (mantissa * mantissa) >> 62;
+        if (mantissa >> 63) {
+            mantissa >>= 1;
+            result |= FixedError{1} << bit;
+        }
+    }
+    return result;
+}
+
+// n * log2(n) for every count a small block can hold, so entropy is
+// evaluated without calling log2 per bin.
+class NLog2NTable {
+public:
+    static constexpr uint64_t kSize = 65536;
+
+    NLog2NTable() : values(kSize + 1, 0) {
+        for (uint64_t n = 2; n <= kSize; ++n) {
+            values[n] = n * fixedLog2(n);
+        }
+    }
+
+    unsigned __int128 operator()(uint64_t n) const {
+        return n <= kSize ? values[n] : static_cast<unsigned __int128>(n) * fixedLog2(n);
+    }
+
+private:
+    vector<FixedError> values;
+};
+
+// Mean channel entropy, using H = (n log2 n - sum f log2 f) / n.
+FixedError calculateEntropyFromHistogram(const BlockHistogram& histogram) {
+    static const NLog2NTable nLog2N;
+    if (histogram.numPixels == 0) return 0;
+
+    unsigned __int128 total = nLog2N(histogram.numPixels);
+    unsigned __int128 entropySum = 0;
+    for (int c = 0; c < 3; ++c) {
+        if (histogram.numUsed[c] <= 1) continue;
+        unsigned __int128 binSum = 0;
+        for (int k = 0; k < histogram.numUsed[c]; ++k) {
+            binSum += nLog2N(histogram.count[c][histogram.used[c][k]]);
+        }
+        entropySum += total - binSum;
+    }
+    unsigned __int128 divisor = histogram.numPixels * 3;
+    return static_cast<FixedError>((entropySum + divisor - 1) / divisor); // rounded up, see fixedRatio
+}
+
+// Exact mean absolute deviation from the histogram. With lo = the values not
+// above the mean, sum |n*v - sum| = 2 * (sum * count(lo) - n * sum(lo)), so
+// only the bins below the mean are visited.
+FixedError calculateMADFromHistogram(const BlockHistogram& histogram) {
+    uint64_t n = histogram.numPixels;
+    if (n == 0) return 0;
+
+    unsigned __int128 deviationSum = 0;
+    for (int c = 0; c < 3; ++c) {
+        uint64_t sum = histogram.sum(c);
+        uint64_t countLo = 0, sumLo = 0;
+        for (int k = 0; k < histogram.numUsed[c]; ++k) {
+            unsigned char v = histogram.used[c][k];
+            if (n * v <= sum) {
+                countLo += histogram.count[c][v];
+                sumLo += static_cast<uint64_t>(histogram.count[c][v]) * v;
+            }
+        }
+        deviationSum += 2 * (sum * countLo - n * sumLo);
+    }
+    return fixedRatio(deviationSum, static_cast<unsigned __int128>(n) * n * 3);
+}
+
+// Exact MAD of a small block straight from its pixels: one pass for each
+// channel's sum S, one for sum |n*v - S|. Both passes vectorize, which beats
+// filling and clearing a histogram until the block is a few thousand
+// pixels. Below kMADDirectArea every term fits in 32 bits.
+constexpr long long kMADDirectArea = 1024;
+
+BlockResult evaluateBlockMADDirect(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    const int n = width * height;
+    uint64_t deviationSum = 0;
+    uint32_t channelSum[3] = {0, 0, 0};
+    for (int c = 0; c < 3; ++c) {
+        uint32_t sum = 0;
+        for (int j = y; j < y + height; ++j) {
+            const unsigned char* row = image.data(x, j, 0, c);
+            for (int i = 0; i < width; ++i) {
+                sum += row[i];
+            }
+        }
+        const int32_t mean = static_cast<int32_t>(sum); // n * mean
+        uint32_t deviation = 0;
+        for (int j = y; j < y + height; ++j) {
+            const unsigned char* row = image.data(x, j, 0, c);
+            for (int i = 0; i < width; ++i) {
+                int32_t d = n * static_cast<int32_t>(row[i]) - mean;
+                deviation += static_cast<uint32_t>(d < 0 ? -d : d);
+            }
+        }
+        channelSum[c] = sum;
+        deviationSum += deviation;
+    }
+
+    double count = static_cast<double>(n);
+    BlockResult result;
+    result.avgColor = {channelSum[0] / count, channelSum[1] / count, channelSum[2] / count};
+    result.error = fixedRatio(deviationSum, static_cast<unsigned __int128>(n) * n * 3);
+    return result;
+}
+
+BlockResult evaluateBlockMAD(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    static thread_local BlockHistogram histogram;
+    BlockResult result;
+    if (width <= 0 || height <= 0) return result;
+    if (static_cast<long long>(width) * height <= kMADDirectArea) {
+        return evaluateBlockMADDirect(image, x, y, width, height);
+    }
+
+    histogram.fill(image, x, y, width, height);
+    result.avgColor = histogram.mean();
+    result.error = calculateMADFromHistogram(histogram);
+    histogram.clear();
+    return result;
+}
+
+BlockResult evaluateBlockEntropy(const CImg<unsigned char>& image, int x, int y, int width, int height) {
+    static thread_local BlockHistogram histogram;
+    BlockResult result;
+    if (width <= 0 || height <= 0) return result;
+
+    histogram.fill(image, x, y, width, height);
+    result.avgColor = histogram.mean();
+    result.error = calculateEntropyFromHistogram(histogram);
+    histogram.clear();
+    return result;
+}
+
+// SSIM of a block against its own flat average. Both means are equal, so
+// the luminance term is 1 and the covariance is the block's variance,
+// which leaves (2 var + C2) / (var + C2) per channel. With C2 = (k2 L)^2 =
+// 23409 / 400 and var = numerator / n^2 the ratio is evaluated in integers.
+FixedError calculateSSIMFromMoments(const BlockMoments& moments) {
+    const unsigned __int128 c2Num = 23409; // (0.03 * 255)^2 = 23409 / 400
+    const unsigned __int128 c2Den = 400;
+
+    if (moments.count == 0) return 0;
+
+    unsigned __int128 n2 = static_cast<unsigned __int128>(moments.count) * moments.count;
+    FixedError ssimSum = 0;
+    for (int c = 0; c < 3; ++c) {
+        unsigned __int128 var = moments.varianceNumerator(c) * c2Den;
+        ssimSum += fixedRatio(2 * var + c2Num * n2, var + c2Num * n2);
+    }
+    return ssimSum / 3;
+}
+
+BlockResult evaluateBlockSSIM(const CImg<unsigned char>& image, const IntegralImage& integral,
+                              int x, int y, int width, int height) {
+    BlockMoments moments = blockMoments(image, integral, x, y, width, height);
+    return {moments.mean(), calculateSSIMFromMoments(moments)};
+}
+
+// Average color and error of every block of the full quadtree, computed
+// bottom-up. Blocks that can no longer split are scanned once, every other
+// block merges the statistics of its four children, so each pixel is read
+// exactly once however deep the tree goes. Thresholding then only has to
+// look the stored results up from the root down.
+//
+// Depths where no block can split any more are not stored; blocks there
+// always become leaves and are averaged directly when they are reached.
+//
+// Building reads the whole image and stores 16 bytes per block of every
+// stored depth, whatever the threshold. That pays off for deep trees, where
+// the recursive builder would rescan each pixel once per level, but not for
+// shallow ones, which the recursive builder finishes after a few scans; so
+// the pyramid is only built on request (--builder=pyramid).
+class StatsPyramid {
+public:
+    void build(const CImg<unsigned char>& image, int errorMethod, int minBlockSize, int threadCount) {
+        imagePtr = &image;
+        method = errorMethod;
+        minBlock = minBlockSize;
+        columns.build(image.width());
+        rows.build(image.height());
+
+        levels.clear();
+        size_t depths = min(columns.starts.size(), rows.starts.size());
+        for (size_t d = 0; d < depths; ++d) {
+            long long w = columns.longest[d], h = rows.longest[d];
+            if (w < 2 || h < 2 || w * h <= minBlockSize) break;
+            levels.emplace_back(columns.starts[d].size() * rows.starts[d].size());
+        }
+
+        // Blocks at taskDepth (or leaves above it) are built as independent
+        // tasks, a few per thread, and their results merged up to the root.
+        taskDepth = 0;
+        while (threadCount > 1 && contains(taskDepth + 1) &&
+               levels[taskDepth].size() < static_cast<size_t>(threadCount) * 4) {
+            ++taskDepth;
+        }
+        vector<TaskBlock> tasks;
+        collectTasks(0, 0, 0, image.width(), image.height(), tasks);
+
+        if (method == 2 || method == 4) {
+            accumulateHistograms(tasks, threadCount);
+        } else if (method == 3) {
+            // Min/max mipmap aligned to the split points.
+            accumulateTasks<BlockRange, scanBlockRange>(tasks, threadCount);
+        } else {
+            accumulateTasks<BlockMoments, scanBlockMoments>(tasks, threadCount);
+        }
+    }
+
+    bool contains(int depth) const {
+        return depth < static_cast<int>(levels.size());
+    }
+
+    BlockResult at(int depth, int x, int y) const {
+        size_t cell = static_cast<size_t>(rows.indexOf[depth][y]) * columns.starts[depth].size() +
+                      columns.indexOf[depth][x];
+        const Cell& stored = levels[depth][cell];
+        return {{static_cast<double>(stored.color[0]), static_cast<double>(stored.color[1]),
+                 static_cast<double>(stored.color[2])},
+                stored.error};
+    }
+
+private:
+    // A stored block. Every consumer truncates the average to bytes (see
+    // QuadtreeNode::setColor), so the cell keeps the truncated color only.
+    struct Cell {
+        FixedError error = 0;
+        unsigned char color[3] = {0, 0, 0};
+    };
+
+    struct TaskBlock {
+        int depth, x, y, width, height;
+    };
+
+    // Leaf of the full tree, or its children are not stored: either way the
+    // block is read straight from the image.
+    bool scannedWhole(int depth, int width, int height) const {
+        return width / 2 == 0 || height / 2 == 0 || width * height <= minBlock || !contains(depth + 1);
+    }
+
+    bool isTask(int depth, int width, int height) const {
+        return depth == taskDepth || scannedWhole(depth, width, height);
+    }
+
+    // Calls visit(x, y, width, height) for the quadrants of a block, NW, NE,
+    // SW, SE.
+    template <class Visit>
+    static void forEachQuadrant(int x, int y, int width, int height, const Visit& visit) {
+        int w1 = width / 2;
+        int h1 = height / 2;
+        visit(x, y, w1, h1);                            // NW
+        visit(x + w1, y, width - w1, h1);               // NE
+        visit(x, y + h1, w1, height - h1);              // SW
+        visit(x + w1, y + h1, width - w1, height - h1); // SE
+    }
+
+    void collectTasks(int depth, int x, int y, int width, int height, vector<TaskBlock>& tasks) const {
+        if (isTask(depth, width, height)) {
+            tasks.push_back({depth, x, y, width, height});
+            return;
+        }
+        forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+            collectTasks(depth + 1, cx, cy, cw, ch, tasks);
+        });
+    }
+
+    template <class Stats, Stats (*scan)(const CImg<unsigned char>&, int, int, int, int)>
+    void accumulateTasks(const vector<TaskBlock>& tasks, int threadCount) {
+        vector<Stats> results(tasks.size());
+        parallelFor(threadCount, static_cast<long long>(tasks.size()), [&](long long i) {
+            const TaskBlock& task = tasks[i];
+            results[i] = accumulate<Stats, scan>(task.depth, task.x, task.y, task.width, task.height);
+        });
+        size_t next = 0;
+        mergeTasks(0, 0, 0, imagePtr->width(), imagePtr->height(), results, next);
+    }
+
+    // Stats of a block above the tasks, from the results of the tasks
+    // under it, taken in the order collectTasks listed them.
+    template <class Stats>
+    Stats mergeTasks(int depth, int x, int y, int width, int height, const vector<Stats>& results, size_t& next) {
+        if (isTask(depth, width, height)) {
+            return results[next++];
+        }
+        Stats stats;
+        forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+            stats.merge(mergeTasks(depth + 1, cx, cy, cw, ch, results, next));
+        });
+        if (contains(depth)) {
+            store(depth, x, y, resultOf(stats));
+        }
+        return stats;
+    }
+
+    template <class Stats, Stats (*scan)(const CImg<unsigned char>&, int, int, int, int)>
+    Stats accumulate(int depth, int x, int y, int width, int height) {
+        Stats stats;
+        if (scannedWhole(depth, width, height)) {
+            stats = scan(*imagePtr, x, y, width, height);
+        } else {
+            forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+                stats.merge(accumulate<Stats, scan>(depth + 1, cx, cy, cw, ch));
+            });
+        }
+
+        if (contains(depth)) {
+            store(depth, x, y, resultOf(stats));
+        }
+        return stats;
+    }
+
+    BlockResult resultOf(const BlockMoments& moments) const {
+        FixedError error = (method == 5) ? calculateSSIMFromMoments(moments) : moments.variance();
+        return {moments.mean(), error};
+    }
+
+    BlockResult resultOf(const BlockRange& range) const {
+        return {range.mean(), range.maxDiff()};
+    }
+
+    BlockResult resultOf(const BlockHistogram& histogram) const {
+        FixedError error = (method == 2) ? calculateMADFromHistogram(histogram)
+                                         : calculateEntropyFromHistogram(histogram);
+        return {histogram.mean(), error};
+    }
+
+    // Histograms are too large to return by value at every level, so each
+    // task fills one buffer per depth, reused by every block there, and
+    // hands its own block's histogram over for the merge.
+    void accumulateHistograms(const vector<TaskBlock>& tasks, int threadCount) {
+        vector<BlockHistogram> results(tasks.size());
+        parallelFor(threadCount, static_cast<long long>(tasks.size()), [&](long long i) {
+            const TaskBlock& task = tasks[i];
+            vector<BlockHistogram> buffers(levels.size() + 1);
+            accumulateHistogram(buffers, task.depth, task.x, task.y, task.width, task.height);
+            results[i].merge(buffers[task.depth]);
+        });
+        vector<BlockHistogram> buffers(taskDepth + 1);
+        size_t next = 0;
+        mergeHistograms(buffers, 0, 0, 0, imagePtr->width(), imagePtr->height(), results, next);
+    }
+
+    // Fills buffers[depth] with the block's histogram; a parent's histogram
+    // is the sum of its children's.
+    void accumulateHistogram(vector<BlockHistogram>& buffers, int depth, int x, int y, int width, int height) {
+        BlockHistogram& histogram = buffers[depth];
+        if (method == 2 && static_cast<long long>(width) * height <= kMADDirectArea) {
+            // Small MAD blocks are cheaper to evaluate from the pixels than
+            // to merge; only the parent still needs the histogram.
+            histogram.fill(*imagePtr, x, y, width, height);
+            storeMADDirect(depth, x, y, width, height);
+            return;
+        }
+        if (scannedWhole(depth, width, height)) {
+            histogram.fill(*imagePtr, x, y, width, height);
+        } else {
+            BlockHistogram& child = buffers[depth + 1];
+            forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+                accumulateHistogram(buffers, depth + 1, cx, cy, cw, ch);
+                histogram.merge(child);
+                child.clear();
+            });
+        }
+
+        if (contains(depth)) {
+            store(depth, x, y, resultOf(histogram));
+        }
+    }
+
+    void storeMADDirect(int depth, int x, int y, int width, int height) {
+        if (contains(depth)) {
+            store(depth, x, y, evaluateBlockMADDirect(*imagePtr, x, y, width, height));
+        }
+        if (!scannedWhole(depth, width, height)) {
+            forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+                storeMADDirect(depth + 1, cx, cy, cw, ch);
+            });
+        }
+    }
+
+    // accumulateHistogram above the tasks, taking each task's histogram from
+    // results instead of the image.
+    void mergeHistograms(vector<BlockHistogram>& buffers, int depth, int x, int y, int width, int height,
+                         const vector<BlockHistogram>& results, size_t& next) {
+        BlockHistogram& histogram = buffers[depth];
+        if (isTask(depth, width, height)) {
+            histogram.merge(results[next++]);
+            return;
+        }
+        BlockHistogram& child = buffers[depth + 1];
+        forEachQuadrant(x, y, width, height, [&](int cx, int cy, int cw, int ch) {
+            mergeHistograms(buffers, depth + 1, cx, cy, cw, ch, results, next);
+            histogram.merge(child);
+            child.clear();
+        });
+        if (contains(depth)) {
+            store(depth, x, y, resultOf(histogram));
+        }
+    }
+
+    void store(int depth, int x, int y, const BlockResult& result) {
+        size_t cell = static_cast<size_t>(rows.indexOf[depth][y]) * columns.starts[depth].size() +
+                      columns.indexOf[depth][x];
+        QuadtreeNode truncated;
+        truncated.setColor(result.avgColor);
+        Cell& stored = levels[depth][cell];
+        stored.error = result.error;
+        copy(begin(truncated.color), end(truncated.color), stored.color);
+    }
+
+    const CImg<unsigned char>* imagePtr = nullptr;
+    int method = 1;
+    int minBlock = 1;
+    int taskDepth = 0;
+    SplitAxis columns, rows;
+    vector<vector<Cell>> levels;
+};
+
+// Precomputed statistics the builder reads block results from. Variance
+// and SSIM only need moments, which the integral image answers for any
+// block. The other methods scan each block they visit unless the pyramid
+// is asked for.
+struct ImageStatistics {
+    const CImg<unsigned char>* image = nullptr;
+    IntegralImage integral;
+    StatsPyramid pyramid;
+
+    void build(const CImg<unsigned char>& img, int errorMethod, int minBlockSize, bool usePyramid,
+               int threadCount) {
+        image = &img;
+        if (usePyramid) {
+            pyramid.build(img, errorMethod, minBlockSize, threadCount);
+        } else if (errorMethod == 1 || errorMethod == 5) {
+            integral.build(img, threadCount);
+        }
+    }
+};
+
+// Node count and depth of a (sub)tree. Every task keeps its own and the
+// totals are merged once the build is done.
+struct BuildCounters {
+    long long nodeCount = 0;
+    int maxDepth = 0;
+
+    void merge(const BuildCounters& other) {
+        nodeCount += other.nodeCount;
+        maxDepth = max(maxDepth, other.maxDepth);
+    }
+};
+
+// Per-thread builder state: its index, counters and allocation cursor.
+struct BuildWorker {
+    int index = 0;
+    BuildCounters counters;
+    QuadtreeArena::Cursor cursor;
+};
+
+struct Quadtree {
+    QuadtreeArena nodes;
+    uint32_t root = 0;
+    int width = 0, height = 0; // the root block
+};
+
+// One leaf of a linear quadtree. code is the leaf's locational code: the
+// quadrants (NW = 0, NE = 1, SW = 2, SE = 3) on its path from the root, two
+// bits per level from the top bits down. Sorting by code gives Z (Morton)
+// order, and a leaf at level L covers the codes [code, code + 4^(32 - L)).
+struct LinearLeaf {
+    uint64_t code = 0;
+    unsigned char level = 0;
+    unsigned char color[3] = {0, 0, 0};
+    unsigned char reserved[4] = {0, 0, 0, 0}; // keeps the serialized bytes defined
+};
+
+static_assert(sizeof(LinearLeaf) == 16 && is_trivially_copyable_v<LinearLeaf>,
+              "LinearLeaf is serialized with memcpy");
+
+// Pointer-free quadtree: only the leaves, sorted by locational code. Blocks
+// are recovered by replaying a leaf's path, point queries are a binary
+// search, and the whole tree serializes with one memcpy.
+class LinearQuadtree {
+public:
+    static constexpr int kMaxLevel = 32;
+    static constexpr uint32_t kMagic = 0x4c545551; // "QUTL"
+
+    int width = 0, height = 0;
+    vector<LinearLeaf> leaves;
+
+    static uint64_t childCode(uint64_t code, int level, int quadrant) {
+        return code | (static_cast<uint64_t>(quadrant) << (2 * (kMaxLevel - 1 - level)));
+    }
+
+    void blockOf(const LinearLeaf& leaf, int& x, int& y, int& w, int& h) const {
+        x = 0;
+        y = 0;
+        w = width;
+        h = height;
+        for (int level = 0; level < leaf.level; ++level) {
+            int q = static_cast<int>(leaf.code >> (2 * (kMaxLevel - 1 - level))) & 3;
+            int w1 = w / 2, h1 = h / 2;
+            if (q & 1) {
+                x += w1;
+                w -= w1;
+            } else {
+                w = w1;
+            }
+            if (q & 2) {
+                y += h1;
+                h -= h1;
+            } else {
+                h = h1;
+            }
+        }
+    }
 
-    QuadtreeNode *children[4] = {nullptr, nullptr, nullptr, nullptr}; // NW, NE, SW, SE
-    int depth = 0;
+    // Leaf containing pixel (px, py), or nullptr outside the image. The
+    // pixel's own code is its path down to a block that cannot split; the
+    // leaf is the last one whose code does not exceed it.
+    const LinearLeaf* leafAt(int px, int py) const {
+        if (px < 0 || py < 0 || px >= width || py >= height || leaves.empty()) return nullptr;
+        uint64_t code = 0;
+        int x = 0, y = 0, w = width, h = height;
+        for (int level = 0; w >= 2 && h >= 2; ++level) {
+            int w1 = w / 2, h1 = h / 2;
+            int q = 0;
+            if (px >= x + w1) {
+                q |= 1;
+                x += w1;
+                w -= w1;
+            } else {
+                w = w1;
+            }
+            if (py >= y + h1) {
+                q |= 2;
+                y += h1;
+                h -= h1;
+            } else {
+                h = h1;
+            }
+            code = childCode(code, level, q);
+        }
+        auto next = upper_bound(leaves.begin(), leaves.end(), code,
+                                [](uint64_t c, const LinearLeaf& leaf) { return c < leaf.code; });
+        return &*(next - 1);
+    }
 
-    QuadtreeNode(int _x, int _y, int _w, int _h, int _d) : x(_x), y(_y), width(_w), height(_h), depth(_d) {}
+    // Bytes serialize() produces for leafCount leaves.
+    static constexpr uint64_t serializedSize(uint64_t leafCount) {
+        return 3 * sizeof(uint32_t) + sizeof(uint64_t) + leafCount * sizeof(LinearLeaf);
+    }
 
-    ~QuadtreeNode() {
-        for (int i = 0; i < 4; ++i) {
-            delete children[i];
+    // Header (magic, width, height, leaf count) followed by the raw leaves.
+    vector<unsigned char> serialize() const {
+        const uint32_t header[3] = {kMagic, static_cast<uint32_t>(width), static_cast<uint32_t>(height)};
+        const uint64_t count = leaves.size();
+        vector<unsigned char> bytes(serializedSize(count));
+        memcpy(bytes.data(), header, sizeof(header));
+        memcpy(bytes.data() + sizeof(header), &count, sizeof(count));
+        if (count > 0) {
+            memcpy(bytes.data() + sizeof(header) + sizeof(count), leaves.data(), count * sizeof(LinearLeaf));
         }
+        return bytes;
     }
 };
 
+// Subtrees covering at least cutoffArea pixels become tasks; smaller ones
+// are built inline by whichever worker reached them. Tasks go to the
+// work-stealing pool, or become OpenMP tasks in the OpenMP build (`make omp`),
+// where pool is null.
+struct ParallelBuild {
+    struct alignas(64) PaddedWorker {
+        BuildWorker worker;
+    };
 
-void printWarning(string message) {
-    cout << "\033[1;31m  !! " << message << "\033[0m\n";
-}
+    WorkStealingPool* pool;
+    long long cutoffArea;
+    vector<PaddedWorker> perWorker;
 
-void printCommand(string message) {
-    cout << "\n\033[2m╭────\033[0m" << message << "\n\033[2m╰─\033[0;32m❯❯ \033[0m";
-}
+    ParallelBuild(WorkStealingPool* pool, int threadCount, long long cutoffArea)
+        : pool(pool), cutoffArea(cutoffArea), perWorker(threadCount) {
+        for (int i = 0; i < threadCount; ++i) {
+            perWorker[i].worker.index = i;
+        }
+    }
 
-void printLine(string message) {
-    cout << "\033[1;32m  ▓╟ " << message << "\033[0m\n";
-}
+    void spawn(function<void()> task) {
+#ifdef _OPENMP
+#pragma omp task firstprivate(task)
+        task();
+#else
+        pool->submit(std::move(task));
+#endif
+    }
 
-void clearCinBuffer() {
-    cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-}
+    BuildWorker& worker() {
+#ifdef _OPENMP
+        return perWorker[omp_get_thread_num()].worker;
+#else
+        return perWorker[WorkStealingPool::currentWorker()].worker;
+#endif
+    }
 
-long long getFileSizeStream(const std::string& filepath) {
-    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-    std::streampos size = file.tellg();
-    file.close();
-    return static_cast<long long>(size);
-}
+    BuildCounters total() const {
+        BuildCounters result;
+        for (const PaddedWorker& padded : perWorker) {
+            result.merge(padded.worker.counters);
+        }
+        return result;
+    }
+};
+
+// Metric policies for the builder. Each one evaluates a block the pyramid
+// does not store, so buildQuadtree is instantiated once per metric and the
+// method is chosen once in main instead of at every node.
+struct VarianceMetric {
+    static BlockResult evaluate(const ImageStatistics& stats, int x, int y, int width, int height) {
+        return evaluateBlockVariance(*stats.image, stats.integral, x, y, width, height);
+    }
+};
+
+struct MADMetric {
+    static BlockResult evaluate(const ImageStatistics& stats, int x, int y, int width, int height) {
+        return evaluateBlockMAD(*stats.image, x, y, width, height);
+    }
+};
 
+struct MaxDiffMetric {
+    static BlockResult evaluate(const ImageStatistics& stats, int x, int y, int width, int height) {
+        return evaluateBlockMaxDiff(*stats.image, x, y, width, height);
+    }
+};
 
-RGB calculateAverageColor(const CImg<unsigned char>& image, int x, int y, int width, int height) {
-    RGB avg = {};
-    double numPixels = static_cast<double>(width) * height;
-    if (numPixels == 0) return avg;
+struct EntropyMetric {
+    static BlockResult evaluate(const ImageStatistics& stats, int x, int y, int width, int height) {
+        return evaluateBlockEntropy(*stats.image, x, y, width, height);
+    }
+};
 
-    double r_sum = 0.0, g_sum = 0.0, b_sum = 0.0;
+struct SSIMMetric {
+    static BlockResult evaluate(const ImageStatistics& stats, int x, int y, int width, int height) {
+        return evaluateBlockSSIM(*stats.image, stats.integral, x, y, width, height);
+    }
+};
 
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            r_sum += image(i, j, 0, 0);
-            g_sum += image(i, j, 0, 1);
-            b_sum += image(i, j, 0, 2);
-        }
+template <class Metric>
+BlockResult evaluateBlock(const ImageStatistics& stats, int x, int y, int width, int height, int depth) {
+    if (stats.pyramid.contains(depth)) {
+        return stats.pyramid.at(depth, x, y);
     }
-    avg.r = r_sum / numPixels;
-    avg.g = g_sum / numPixels;
-    avg.b = b_sum / numPixels;
-    return avg;
+    return Metric::evaluate(stats, x, y, width, height);
 }
 
-double calculateErrorVariance(const CImg<unsigned char>& image, int x, int y, int width, int height, const RGB& avgColor) {
-    double numPixels = static_cast<double>(width) * height;
-    if (numPixels <= 1) return 0.0;
+// Evaluates a block into result, counts it, and decides whether it splits.
+template <class Metric>
+bool splitBlock(const ImageStatistics& stats, int x, int y, int width, int height, FixedError threshold,
+                int minBlockSize, int currentDepth, BuildCounters& counters, BlockResult& result) {
+
+    counters.nodeCount++;
+    if (currentDepth > counters.maxDepth) {
+        counters.maxDepth = currentDepth;
+    }
+
+    result = evaluateBlock<Metric>(stats, x, y, width, height, currentDepth);
+    FixedError error = result.error;
+
+
+    int nextWidth = width / 2;
+    int nextHeight = height / 2;
+    bool subBlocksTooSmall = (nextWidth == 0 || nextHeight == 0);
+
 
-    double r_var_sum = 0.0, g_var_sum = 0.0, b_var_sum = 0.0;
+    return !(error < threshold || (width * height) <= minBlockSize || subBlocksTooSmall);
+}
 
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            double r_diff = image(i, j, 0, 0) - avgColor.r;
-            double g_diff = image(i, j, 0, 1) - avgColor.g;
-            double b_diff = image(i, j, 0, 2) - avgColor.b;
-            r_var_sum += r_diff * r_diff;
-            g_var_sum += g_diff * g_diff;
-            b_var_sum += b_diff * b_diff;
+// Calls visit(q, x, y, width, height, worker) for the quadrants of a block
+// (NW, NE, SW, SE). Quadrants of at least the parallel cutoff run as tasks
+// with the worker that picks them up, so visit must capture by value
+// anything that lives in the caller's frame.
+template <class Visit>
+void visitChildren(int x, int y, int width, int height, BuildWorker& worker, ParallelBuild* parallel,
+                   const Visit& visit) {
+    int w1 = width / 2;
+    int h1 = height / 2;
+    int w2 = width - w1;
+    int h2 = height - h1;
+
+    const int childX[4] = {x, x + w1, x, x + w1};
+    const int childY[4] = {y, y, y + h1, y + h1};
+    const int childW[4] = {w1, w2, w1, w2};
+    const int childH[4] = {h1, h1, h2, h2};
+    for (int q = 0; q < 4; ++q) { // NW, NE, SW, SE
+        if (parallel && static_cast<long long>(childW[q]) * childH[q] >= parallel->cutoffArea) {
+            int cx = childX[q], cy = childY[q], cw = childW[q], ch = childH[q];
+            parallel->spawn([=] {
+                visit(q, cx, cy, cw, ch, parallel->worker());
+            });
+        } else {
+            visit(q, childX[q], childY[q], childW[q], childH[q], worker);
         }
     }
+}
 
-    double r_variance = r_var_sum / numPixels;
-    double g_variance = g_var_sum / numPixels;
-    double b_variance = b_var_sum / numPixels;
+// Runs build(worker, parallel) for the root, on the calling thread alone or
+// on threadCount workers, and returns once the whole tree is done.
+template <class Build>
+BuildCounters runBuild(int threadCount, long long cutoffArea, const Build& build) {
+    if (threadCount <= 1) {
+        BuildWorker worker;
+        build(worker, nullptr);
+        return worker.counters;
+    }
 
-    return (r_variance + g_variance + b_variance) / 3.0;
+#ifdef _OPENMP
+    ParallelBuild parallel(nullptr, threadCount, cutoffArea);
+#pragma omp parallel num_threads(threadCount)
+#pragma omp single
+    build(parallel.worker(), &parallel);
+#else
+    WorkStealingPool pool(threadCount);
+    ParallelBuild parallel(&pool, threadCount, cutoffArea);
+    build(parallel.worker(), &parallel);
+    pool.wait();
+#endif
+    return parallel.total();
 }
 
-double calculateErrorMAD(const CImg<unsigned char>& image, int x, int y, int width, int height, const RGB& avgColor) {
-    double numPixels = static_cast<double>(width) * height;
-    if (numPixels == 0) return 0.0;
-
-    double r_mad_sum = 0.0, g_mad_sum = 0.0, b_mad_sum = 0.0;
+// Fills nodes[index] with the block and, if it splits, its subtree.
+template <class Metric>
+void buildQuadtree(const ImageStatistics& stats, QuadtreeArena& nodes, uint32_t index,
+                   int x, int y, int width, int height, FixedError threshold, int minBlockSize,
+                   int currentDepth, BuildWorker& worker, ParallelBuild* parallel) {
+    QuadtreeNode& node = nodes[index];
+    node = QuadtreeNode{};
+
+    BlockResult result;
+    bool split = splitBlock<Metric>(stats, x, y, width, height, threshold, minBlockSize, currentDepth,
+                                    worker.counters, result);
+    node.setColor(result.avgColor);
+    if (!split) return;
+
+    uint32_t first = nodes.allocate(worker.cursor, 4);
+    node.firstChild = first;
+    visitChildren(x, y, width, height, worker, parallel,
+                  [=, &stats, &nodes](int q, int cx, int cy, int cw, int ch, BuildWorker& childWorker) {
+                      buildQuadtree<Metric>(stats, nodes, first + q, cx, cy, cw, ch, threshold, minBlockSize,
+                                            currentDepth + 1, childWorker, parallel);
+                  });
+}
 
-    int x_end = min(x + width, image.width());
-    int y_end = min(y + height, image.height());
+template <class Metric>
+void buildQuadtree(const ImageStatistics& stats, Quadtree& tree, int width, int height, FixedError threshold,
+                   int minBlockSize, int threadCount, long long cutoffArea, BuildCounters& counters) {
+    tree.width = width;
+    tree.height = height;
+    counters = runBuild(threadCount, cutoffArea, [&](BuildWorker& worker, ParallelBuild* parallel) {
+        tree.root = tree.nodes.allocate(worker.cursor, 1);
+        buildQuadtree<Metric>(stats, tree.nodes, tree.root, 0, 0, width, height, threshold, minBlockSize, 0,
+                              worker, parallel);
+    });
+}
 
-    for (int j = y; j < y_end; ++j) {
-        for (int i = x; i < x_end; ++i) {
-            r_mad_sum += abs(image(i, j, 0, 0) - avgColor.r);
-            g_mad_sum += abs(image(i, j, 0, 1) - avgColor.g);
-            b_mad_sum += abs(image(i, j, 0, 2) - avgColor.b);
+// Level-synchronous builder. Each depth is a frontier array of blocks that
+// is evaluated as one batch, cut into equal slices across the workers,
+// before the children of the blocks that split become the next frontier.
+// There is no recursion, and the nodes of a level sit next to each other in
+// the arena. Produces the same tree as the depth-first builder.
+template <class Metric>
+void buildQuadtreeBreadthFirst(const ImageStatistics& stats, Quadtree& tree, int width, int height,
+                               FixedError threshold, int minBlockSize, int threadCount, BuildCounters& counters) {
+    struct FrontierBlock {
+        uint32_t index;
+        int x, y, width, height;
+    };
+    constexpr size_t kMinSlice = 1024; // smaller levels are not worth sharing out
+
+    tree.width = width;
+    tree.height = height;
+    QuadtreeArena::Cursor cursor;
+    tree.root = tree.nodes.allocate(cursor, 1);
+
+    vector<FrontierBlock> frontier = {{tree.root, 0, 0, width, height}};
+    vector<FrontierBlock> next;
+    vector<unsigned char> splits;
+    vector<BuildCounters> sliceCounters(max(1, threadCount));
+#ifndef _OPENMP
+    unique_ptr<WorkStealingPool> pool;
+    if (threadCount > 1) pool = make_unique<WorkStealingPool>(threadCount);
+#endif
+
+    for (int depth = 0; !frontier.empty(); ++depth) {
+        const size_t count = frontier.size();
+        splits.assign(count, 0);
+        const int slices = static_cast<int>(min<size_t>(sliceCounters.size(), (count + kMinSlice - 1) / kMinSlice));
+
+        auto evaluateSlice = [&](int slice) {
+            size_t begin = count * slice / slices;
+            size_t end = count * (slice + 1) / slices;
+            for (size_t i = begin; i < end; ++i) {
+                const FrontierBlock& block = frontier[i];
+                BlockResult result;
+                splits[i] = splitBlock<Metric>(stats, block.x, block.y, block.width, block.height, threshold,
+                                               minBlockSize, depth, sliceCounters[slice], result);
+                QuadtreeNode& node = tree.nodes[block.index];
+                node = QuadtreeNode{};
+                node.setColor(result.avgColor);
+            }
+        };
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(slices) schedule(static)
+        for (int slice = 0; slice < slices; ++slice) {
+            evaluateSlice(slice);
+        }
+#else
+        for (int slice = 1; slice < slices; ++slice) {
+            pool->submit([&evaluateSlice, slice] { evaluateSlice(slice); });
         }
+        evaluateSlice(0);
+        if (pool) pool->wait();
+#endif
+
+        next.clear();
+        for (size_t i = 0; i < count; ++i) {
+            if (!splits[i]) continue;
+            const FrontierBlock& block = frontier[i];
+            uint32_t first = tree.nodes.allocate(cursor, 4);
+            tree.nodes[block.index].firstChild = first;
+
+            int w1 = block.width / 2;
+            int h1 = block.height / 2;
+            int w2 = block.width - w1;
+            int h2 = block.height - h1;
+            next.push_back({first, block.x, block.y, w1, h1});                 // NW
+            next.push_back({first + 1, block.x + w1, block.y, w2, h1});        // NE
+            next.push_back({first + 2, block.x, block.y + h1, w1, h2});        // SW
+            next.push_back({first + 3, block.x + w1, block.y + h1, w2, h2});   // SE
+        }
+        frontier.swap(next);
     }
 
-    numPixels = static_cast<double>(x_end - x) * (y_end - y);
-    if (numPixels <= 0) return 0.0;
+    counters = BuildCounters{};
+    for (const BuildCounters& slice : sliceCounters) {
+        counters.merge(slice);
+    }
+}
 
-    double r_mad = r_mad_sum / numPixels;
-    double g_mad = g_mad_sum / numPixels;
-    double b_mad = b_mad_sum / numPixels;
+// A leaf waiting in the best-first queue.
+struct SplitCandidate {
+    FixedError error;
+    uint32_t index;
+    int x, y, width, height, depth;
+};
 
-    return (r_mad + g_mad + b_mad) / 3.0;
+// Node budget that fits in maxBytes, counting each node's storage plus its
+// worst-case slot in the best-first queue.
+long long nodesForBytes(long long maxBytes) {
+    return maxBytes / static_cast<long long>(sizeof(QuadtreeNode) + sizeof(SplitCandidate));
 }
 
-double calculateErrorMaxDiff(const CImg<unsigned char>& image, int x, int y, int width, int height) {
-    if (width <= 0 || height <= 0) return 0.0;
-    unsigned char minR = 255, maxR = 0;
-    unsigned char minG = 255, maxG = 0;
-    unsigned char minB = 255, maxB = 0;
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            unsigned char r = image(i, j, 0, 0);
-            unsigned char g = image(i, j, 0, 1);
-            unsigned char b = image(i, j, 0, 2);
-            if (r < minR) minR = r;
-            if (r > maxR) maxR = r;
-            if (g < minG) minG = g;
-            if (g > maxG) maxG = g;
-            if (b < minB) minB = b;
-            if (b > maxB) maxB = b;
-        }
+// Node budget whose best-first tree has the leaf count closest to target.
+// Every split turns one leaf into four, so a tree with s splits has 1 + 3s
+// leaves and 1 + 4s nodes; targets that are not 1 mod 3 round to the
+// nearest such count. The image may also run out of
+// splittable blocks first, in which case every block ends up split.
+long long nodesForLeaves(long long targetLeaves) {
+    long long splits = targetLeaves / 3; // round((target - 1) / 3)
+    return 1 + 4 * splits;
+}
+
+// Best-first builder: always splits the leaf with the largest error next,
+// among the leaves that the threshold and minimum block size would split,
+// and stops before the tree grows past maxNodes. With a budget that is
+// never reached it builds the same tree as the other builders; with a tight
+// one it spends the nodes where the error is worst.
+template <class Metric>
+void buildQuadtreeBestFirst(const ImageStatistics& stats, Quadtree& tree, int width, int height,
+                            FixedError threshold, int minBlockSize, long long maxNodes, BuildCounters& counters) {
+    // Largest error first; ties go to the older node, so the result is deterministic.
+    auto lessUrgent = [](const SplitCandidate& a, const SplitCandidate& b) {
+        return a.error != b.error ? a.error < b.error : a.index > b.index;
+    };
+    priority_queue<SplitCandidate, vector<SplitCandidate>, decltype(lessUrgent)> queue(lessUrgent);
+
+    tree.width = width;
+    tree.height = height;
+    counters = BuildCounters{};
+    QuadtreeArena::Cursor cursor;
+
+    auto evaluate = [&](uint32_t index, int x, int y, int w, int h, int depth) {
+        BlockResult result;
+        bool split = splitBlock<Metric>(stats, x, y, w, h, threshold, minBlockSize, depth, counters, result);
+        QuadtreeNode& node = tree.nodes[index];
+        node = QuadtreeNode{};
+        node.setColor(result.avgColor);
+        if (split) queue.push({result.error, index, x, y, w, h, depth});
+    };
+
+    tree.root = tree.nodes.allocate(cursor, 1);
+    evaluate(tree.root, 0, 0, width, height, 0);
+
+    // Every split adds four nodes, so once the worst leaf no longer fits
+    // the budget, none does.
+    while (!queue.empty() && counters.nodeCount + 4 <= maxNodes) {
+        SplitCandidate block = queue.top();
+        queue.pop();
+
+        uint32_t first = tree.nodes.allocate(cursor, 4);
+        tree.nodes[block.index].firstChild = first;
+
+        int w1 = block.width / 2;
+        int h1 = block.height / 2;
+        int w2 = block.width - w1;
+        int h2 = block.height - h1;
+        evaluate(first, block.x, block.y, w1, h1, block.depth + 1);                 // NW
+        evaluate(first + 1, block.x + w1, block.y, w2, h1, block.depth + 1);        // NE
+        evaluate(first + 2, block.x, block.y + h1, w1, h2, block.depth + 1);        // SW
+        evaluate(first + 3, block.x + w1, block.y + h1, w2, h2, block.depth + 1);   // SE
     }
-    double DR = static_cast<double>(maxR - minR);
-    double DG = static_cast<double>(maxG - minG);
-    double DB = static_cast<double>(maxB - minB);
-    double DRGB = (DR + DG + DB) / 3.0;
-    return DRGB;
 }
 
-double calculateEntropy(const CImg<unsigned char>& image, int x, int y, int width, int height) {
-    if (width <= 0 || height <= 0) return 0.0;
-    std::vector<int> freqR(256, 0), freqG(256, 0), freqB(256, 0);
-    int totalPixels = width * height;
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            unsigned char r = image(i, j, 0, 0);
-            unsigned char g = image(i, j, 0, 1);
-            unsigned char b = image(i, j, 0, 2);
-            freqR[r]++;
-            freqG[g]++;
-            freqB[b]++;
-        }
+// Builds the tree without storing it: every final leaf is handed to
+// sink.leaf(worker, code, level, x, y, width, height, color) as soon as it
+// is known. code is the leaf's locational code (see LinearQuadtree).
+template <class Metric, class Sink>
+void buildLeaves(const ImageStatistics& stats, Sink& sink, uint64_t code,
+                 int x, int y, int width, int height, FixedError threshold, int minBlockSize,
+                 int currentDepth, BuildWorker& worker, ParallelBuild* parallel) {
+    BlockResult result;
+    if (!splitBlock<Metric>(stats, x, y, width, height, threshold, minBlockSize, currentDepth,
+                            worker.counters, result)) {
+        QuadtreeNode leaf;
+        leaf.setColor(result.avgColor);
+        sink.leaf(worker, code, currentDepth, x, y, width, height, leaf.color);
+        return;
     }
-    auto calculateChannelEntropy = [&](const std::vector<int>& freq) -> double {
-        double entropy = 0.0;
-        for (int i = 0; i < 256; ++i) {
-            if (freq[i] > 0) {
-                double probability = static_cast<double>(freq[i]) / totalPixels;
-                entropy -= probability * std::log2(probability);
-            }
-        }
-        return entropy;
-    };
-    double entropyR = calculateChannelEntropy(freqR);
-    double entropyG = calculateChannelEntropy(freqG);
-    double entropyB = calculateChannelEntropy(freqB);
-    double entropyRGB = (entropyR + entropyG + entropyB) / 3.0;
-    return entropyRGB;
+
+    visitChildren(x, y, width, height, worker, parallel,
+                  [=, &stats, &sink](int q, int cx, int cy, int cw, int ch, BuildWorker& childWorker) {
+                      buildLeaves<Metric>(stats, sink, LinearQuadtree::childCode(code, currentDepth, q),
+                                          cx, cy, cw, ch, threshold, minBlockSize, currentDepth + 1,
+                                          childWorker, parallel);
+                  });
 }
 
-double calculateSSIM(const CImg<unsigned char>& originalImage, int x, int y, int width, int height, 
-    const RGB& avgColor) {
-    const double L = 255.0; 
-    const double k1 = 0.01;  
-    const double k2 = 0.03;  
-    const double C1 = (k1 * L) * (k1 * L);  // (k1*L)²
-    const double C2 = (k2 * L) * (k2 * L);  // (k2*L)²
+// Collects leaves into one buffer per worker, merged in code order at the end.
+struct LinearLeafSink {
+    vector<vector<LinearLeaf>> perWorker;
 
-    const double wR = 1.0/3.0;
-    const double wG = 1.0/3.0;
-    const double wB = 1.0/3.0;
+    explicit LinearLeafSink(int threadCount) : perWorker(max(1, threadCount)) {}
 
-    double meanR_orig = 0.0, meanG_orig = 0.0, meanB_orig = 0.0;
-    double varR_orig = 0.0, varG_orig = 0.0, varB_orig = 0.0;
+    void leaf(BuildWorker& worker, uint64_t code, int level, int, int, int, int, const unsigned char* color) {
+        LinearLeaf leaf;
+        leaf.code = code;
+        leaf.level = static_cast<unsigned char>(level);
+        leaf.color[0] = color[0];
+        leaf.color[1] = color[1];
+        leaf.color[2] = color[2];
+        perWorker[worker.index].push_back(leaf);
+    }
 
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            meanR_orig += originalImage(i, j, 0, 0);
-            meanG_orig += originalImage(i, j, 0, 1);
-            meanB_orig += originalImage(i, j, 0, 2);
+    void finish(LinearQuadtree& linear) {
+        for (vector<LinearLeaf>& leaves : perWorker) {
+            linear.leaves.insert(linear.leaves.end(), leaves.begin(), leaves.end());
+            vector<LinearLeaf>().swap(leaves);
+        }
+        // A single worker emits leaves in depth-first order, which is already
+        // code order; subtrees built by other workers have to be merged.
+        if (perWorker.size() > 1) {
+            sort(linear.leaves.begin(), linear.leaves.end(),
+                 [](const LinearLeaf& a, const LinearLeaf& b) { return a.code < b.code; });
         }
     }
+};
+
+// Draws each leaf into the output image as soon as it is final. Leaves never
+// overlap, so workers draw without locking.
+struct RasterLeafSink {
+    CImg<unsigned char>& outputImage;
+
+    void leaf(BuildWorker&, uint64_t, int, int x, int y, int width, int height, const unsigned char* color) {
+        outputImage.draw_rectangle(x, y, x + width - 1, y + height - 1, color, 1.0f);
+    }
+};
 
-    double numPixels = width * height;
-    meanR_orig /= numPixels;
-    meanG_orig /= numPixels;
-    meanB_orig /= numPixels;
+template <class Metric>
+void buildLinearQuadtree(const ImageStatistics& stats, LinearQuadtree& linear, int width, int height,
+                         FixedError threshold, int minBlockSize, int threadCount, long long cutoffArea,
+                         BuildCounters& counters) {
+    linear.width = width;
+    linear.height = height;
+    LinearLeafSink sink(threadCount);
+    counters = runBuild(threadCount, cutoffArea, [&](BuildWorker& worker, ParallelBuild* parallel) {
+        buildLeaves<Metric>(stats, sink, 0, 0, 0, width, height, threshold, minBlockSize, 0, worker, parallel);
+    });
+    sink.finish(linear);
+}
 
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            double diffR = originalImage(i, j, 0, 0) - meanR_orig;
-            double diffG = originalImage(i, j, 0, 1) - meanG_orig;
-            double diffB = originalImage(i, j, 0, 2) - meanB_orig;
+// Draws the subtree at index, whose block is (x, y, width, height). In the
+// OpenMP build, subtrees of at least taskCutoff pixels are drawn as separate
+// tasks when called inside a parallel region; leaves never overlap.
+void reconstructImage(CImg<unsigned char>& outputImage, const QuadtreeArena& nodes, uint32_t index,
+                      int x, int y, int width, int height, long long taskCutoff = 0) {
+    const QuadtreeNode& node = nodes[index];
 
-            varR_orig += diffR * diffR;
-            varG_orig += diffG * diffG;
-            varB_orig += diffB * diffB;
+    if (node.isLeaf()) {
+        // CImg draw_rectangle(x0, y0, x1, y1, color, opacity)
+        outputImage.draw_rectangle(x, y, x + width - 1, y + height - 1, node.color, 1.0f);
+    } else {
+        int w1 = width / 2;
+        int h1 = height / 2;
+        const int childX[4] = {x, x + w1, x, x + w1};
+        const int childY[4] = {y, y, y + h1, y + h1};
+        const int childW[4] = {w1, width - w1, w1, width - w1};
+        const int childH[4] = {h1, h1, height - h1, height - h1};
+        for (int q = 0; q < 4; ++q) { // NW, NE, SW, SE
+#ifdef _OPENMP
+            bool spawn = taskCutoff > 0 && static_cast<long long>(childW[q]) * childH[q] >= taskCutoff;
+#pragma omp task if(spawn) shared(outputImage, nodes)
+#endif
+            reconstructImage(outputImage, nodes, node.firstChild + q,
+                             childX[q], childY[q], childW[q], childH[q], taskCutoff);
         }
     }
+}
+
+void reconstructImage(CImg<unsigned char>& outputImage, const Quadtree& tree, long long taskCutoff = 0) {
+    reconstructImage(outputImage, tree.nodes, tree.root, 0, 0, tree.width, tree.height, taskCutoff);
+}
+
+void reconstructImage(CImg<unsigned char>& outputImage, const LinearQuadtree& linear) {
+    const long long count = static_cast<long long>(linear.leaves.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (long long i = 0; i < count; ++i) {
+        const LinearLeaf& leaf = linear.leaves[i];
+        int x, y, w, h;
+        linear.blockOf(leaf, x, y, w, h);
+        outputImage.draw_rectangle(x, y, x + w - 1, y + h - 1, leaf.color, 1.0f);
+    }
+}
 
-    varR_orig /= numPixels;
-    varG_orig /= numPixels;
-    varB_orig /= numPixels;
+// The full tree down to the minimum block size, with the error of every
+// node kept next to it. A node of the cut for a threshold is a leaf when it
+// has no children or its error is below the threshold, which is the rule
+// the builders apply, so a cut gives the same tree a fresh build would and
+// a new threshold costs a walk over the cut instead of a rebuild.
+class ErrorCachedTree {
+public:
+    int width = 0, height = 0;
+    vector<QuadtreeNode> nodes;  // root at 0, children in groups of 4
+    vector<FixedError> errors;   // errors[i] belongs to nodes[i]
+    vector<uint64_t> squaredErrors;  // filled by measureSquaredErrors
+
+    template <class Metric>
+    void build(const ImageStatistics& stats, int imageWidth, int imageHeight, int minBlockSize) {
+        width = imageWidth;
+        height = imageHeight;
+        nodes.assign(1, QuadtreeNode{});
+        errors.assign(1, 0);
+        squaredErrors.clear();
+        fill<Metric>(stats, 0, 0, 0, width, height, minBlockSize, 0);
+    }
 
-    double meanR_comp = avgColor.r;
-    double meanG_comp = avgColor.g;
-    double meanB_comp = avgColor.b;
+    // Draws the cut for threshold and returns its node count and depth.
+    BuildCounters draw(CImg<unsigned char>& outputImage, FixedError threshold) const {
+        BuildCounters counters;
+        draw(outputImage, threshold, 0, 0, 0, width, height, 0, counters);
+        return counters;
+    }
 
-    double covR = 0.0, covG = 0.0, covB = 0.0;
+    // For every node but the root, the smallest error among its ancestors,
+    // sorted. A node is in the cut for t exactly when that value is >= t, so
+    // these are the only thresholds at which the cut changes, and the cut
+    // for t has 1 + (number of values >= t) nodes.
+    vector<FixedError> breakpoints() const {
+        vector<FixedError> values;
+        values.reserve(nodes.size() - 1);
+        collectBreakpoints(0, numeric_limits<FixedError>::max(), values);
+        sort(values.begin(), values.end());
+        return values;
+    }
 
-    for (int j = y; j < y + height; ++j) {
-        for (int i = x; i < x + width; ++i) {
-            double diffR_orig = originalImage(i, j, 0, 0) - meanR_orig;
-            double diffG_orig = originalImage(i, j, 0, 1) - meanG_orig;
-            double diffB_orig = originalImage(i, j, 0, 2) - meanB_orig;
+    // Sum over channels and pixels of (pixel - drawn colour)^2 for every
+    // node's block, from moments merged up from the full tree's leaves, so
+    // the image is read once.
+    void measureSquaredErrors(const CImg<unsigned char>& image) {
+        squaredErrors.assign(nodes.size(), 0);
+        measureSquaredErrors(image, 0, 0, 0, width, height);
+    }
 
-            double diffR_comp = originalImage(i, j, 0, 0) - meanR_comp;
-            double diffG_comp = originalImage(i, j, 0, 1) - meanG_comp;
-            double diffB_comp = originalImage(i, j, 0, 2) - meanB_comp;
+private:
+    BlockMoments measureSquaredErrors(const CImg<unsigned char>& image, uint32_t index, int x, int y, int w, int h) {
+        const QuadtreeNode& node = nodes[index];
+        BlockMoments moments;
+        if (node.isLeaf()) {
+            moments = scanBlockMoments(image, x, y, w, h);
+        } else {
+            int w1 = w / 2;
+            int h1 = h / 2;
+            moments.merge(measureSquaredErrors(image, node.firstChild + 0, x, y, w1, h1));
+            moments.merge(measureSquaredErrors(image, node.firstChild + 1, x + w1, y, w - w1, h1));
+            moments.merge(measureSquaredErrors(image, node.firstChild + 2, x, y + h1, w1, h - h1));
+            moments.merge(measureSquaredErrors(image, node.firstChild + 3, x + w1, y + h1, w - w1, h - h1));
+        }
+        uint64_t total = 0;
+        for (int c = 0; c < 3; ++c) {
+            uint64_t v = node.color[c];
+            total += moments.sumSq[c] + moments.count * v * v - 2 * v * moments.sum[c];
+        }
+        squaredErrors[index] = total;
+        return moments;
+    }
 
-            covR += diffR_orig * diffR_comp;
-            covG += diffG_orig * diffG_comp;
-            covB += diffB_orig * diffB_comp;
+    void collectBreakpoints(uint32_t index, FixedError ancestorMin, vector<FixedError>& values) const {
+        const QuadtreeNode& node = nodes[index];
+        if (node.isLeaf()) {
+            return;
+        }
+        FixedError childMin = min(ancestorMin, errors[index]);
+        for (uint32_t q = 0; q < 4; ++q) {
+            values.push_back(childMin);
+            collectBreakpoints(node.firstChild + q, childMin, values);
         }
     }
 
-    covR /= numPixels;
-    covG /= numPixels;
-    covB /= numPixels;
+    template <class Metric>
+    void fill(const ImageStatistics& stats, uint32_t index, int x, int y, int w, int h,
+              int minBlockSize, int depth) {
+        BuildCounters unused;
+        BlockResult result;
+        bool split = splitBlock<Metric>(stats, x, y, w, h, numeric_limits<FixedError>::min(),
+                                        minBlockSize, depth, unused, result);
+        nodes[index].setColor(result.avgColor);
+        errors[index] = result.error;
+        if (!split) {
+            return;
+        }
 
-    double ssimR = ((2 * meanR_orig * meanR_comp + C1) * (2 * covR + C2)) / 
-    ((meanR_orig * meanR_orig + meanR_comp * meanR_comp + C1) * (varR_orig + 0 + C2));
+        // The vectors may grow under the children, so index rather than refer.
+        uint32_t first = static_cast<uint32_t>(nodes.size());
+        nodes[index].firstChild = first;
+        nodes.resize(nodes.size() + 4);
+        errors.resize(errors.size() + 4);
+        int w1 = w / 2;
+        int h1 = h / 2;
+        fill<Metric>(stats, first + 0, x, y, w1, h1, minBlockSize, depth + 1);
+        fill<Metric>(stats, first + 1, x + w1, y, w - w1, h1, minBlockSize, depth + 1);
+        fill<Metric>(stats, first + 2, x, y + h1, w1, h - h1, minBlockSize, depth + 1);
+        fill<Metric>(stats, first + 3, x + w1, y + h1, w - w1, h - h1, minBlockSize, depth + 1);
+    }
 
-    double ssimG = ((2 * meanG_orig * meanG_comp + C1) * (2 * covG + C2)) / 
-    ((meanG_orig * meanG_orig + meanG_comp * meanG_comp + C1) * (varG_orig + 0 + C2));
+    void draw(CImg<unsigned char>& outputImage, FixedError threshold, uint32_t index,
+              int x, int y, int w, int h, int depth, BuildCounters& counters) const {
+        counters.nodeCount++;
+        counters.maxDepth = max(counters.maxDepth, depth);
+        const QuadtreeNode& node = nodes[index];
+        if (node.isLeaf() || errors[index] < threshold) {
+            outputImage.draw_rectangle(x, y, x + w - 1, y + h - 1, node.color, 1.0f);
+            return;
+        }
+        int w1 = w / 2;
+        int h1 = h / 2;
+        draw(outputImage, threshold, node.firstChild + 0, x, y, w1, h1, depth + 1, counters);
+        draw(outputImage, threshold, node.firstChild + 1, x + w1, y, w - w1, h1, depth + 1, counters);
+        draw(outputImage, threshold, node.firstChild + 2, x, y + h1, w1, h - h1, depth + 1, counters);
+        draw(outputImage, threshold, node.firstChild + 3, x + w1, y + h1, w - w1, h - h1, depth + 1, counters);
+    }
+};
 
-    double ssimB = ((2 * meanB_orig * meanB_comp + C1) * (2 * covB + C2)) / 
-    ((meanB_orig * meanB_orig + meanB_comp * meanB_comp + C1) * (varB_orig + 0 + C2));
+// One cut of a rate-distortion curve.
+struct RatePoint {
+    FixedError threshold = 0;   // lowest threshold that gives this cut
+    long long leaves = 0;
+    long long nodes = 0;
+    uint64_t squaredError = 0;  // over all pixels and channels
+};
 
-    double ssimRGB = wR * ssimR + wG * ssimG + wB * ssimB;
-    return ssimRGB;
+// Every distinct cut of an error-cached tree with measured squared errors,
+// from the full tree to the root alone. A split node stops splitting once
+// the threshold passes the smallest error on its path from the root, so
+// collapsing split nodes in that order (deepest first on ties) prunes the
+// tree from the bottom up, and each collapse updates the totals from the
+// node's and its four leaf children's squared errors.
+vector<RatePoint> rateDistortionCurve(const ErrorCachedTree& cache) {
+    struct Collapse {
+        FixedError pathMin;
+        int depth;
+        uint32_t index;
+    };
+    vector<Collapse> order;
+    RatePoint point;
+    point.nodes = static_cast<long long>(cache.nodes.size());
+    // Walk the full tree iteratively, collecting split nodes and leaf totals.
+    vector<Collapse> stack = {{numeric_limits<FixedError>::max(), 0, 0}};
+    while (!stack.empty()) {
+        Collapse visit = stack.back();
+        stack.pop_back();
+        const QuadtreeNode& node = cache.nodes[visit.index];
+        if (node.isLeaf()) {
+            point.leaves++;
+            point.squaredError += cache.squaredErrors[visit.index];
+            continue;
+        }
+        FixedError pathMin = min(visit.pathMin, cache.errors[visit.index]);
+        order.push_back({pathMin, visit.depth, visit.index});
+        for (uint32_t q = 0; q < 4; ++q) {
+            stack.push_back({pathMin, visit.depth + 1, node.firstChild + q});
+        }
+    }
+    sort(order.begin(), order.end(), [](const Collapse& a, const Collapse& b) {
+        return a.pathMin != b.pathMin ? a.pathMin < b.pathMin : a.depth > b.depth;
+    });
+
+    vector<RatePoint> curve = {point};
+    for (size_t i = 0; i < order.size(); ++i) {
+        uint32_t index = order[i].index;
+        uint32_t first = cache.nodes[index].firstChild;
+        point.squaredError += cache.squaredErrors[index];
+        for (uint32_t q = 0; q < 4; ++q) {
+            point.squaredError -= cache.squaredErrors[first + q];
+        }
+        point.leaves -= 3;
+        point.nodes -= 4;
+        if (i + 1 == order.size() || order[i + 1].pathMin != order[i].pathMin) {
+            point.threshold = order[i].pathMin + 1;
+            curve.push_back(point);
+        }
+    }
+    return curve;
 }
 
-long long nodeCount = 0;
-int maxDepth = 0;
+// Mean squared error per channel sample and the matching PSNR in dB
+// (infinite for an exact reconstruction).
+double meanSquaredError(uint64_t squaredError, int width, int height) {
+    return static_cast<double>(squaredError) / (3.0 * width * height);
+}
 
-QuadtreeNode* buildQuadtree(const CImg<unsigned char>& image, int x, int y, int width, int height,
-                            double threshold, int minBlockSize, int currentDepth, int errorMethod) {
+double psnrFromMSE(double mse) {
+    return mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : numeric_limits<double>::infinity();
+}
 
-    nodeCount++;
-    if (currentDepth > maxDepth) {
-        maxDepth = currentDepth;
-    }
+// Outcome of a threshold search over an error-cached tree.
+struct ThresholdSearch {
+    FixedError threshold = 0;
+    long long size = -1;   // measured size of the chosen cut
+    int probes = 0;
+    bool reached = false;  // false if even the root alone is over the target
+};
 
-    QuadtreeNode* node = new QuadtreeNode(x, y, width, height, currentDepth);
+// Finds the lowest threshold whose cut measures at most targetSize, i.e. the
+// most detailed tree that fits, calling measure(threshold) for the size of a
+// cut. Only the breakpoints can change the cut, so the search runs over
+// their positions, where position p stands for the cut with 1 + n - p nodes.
+// The output size grows roughly linearly with the node count, so each probe
+// interpolates between the bracketing cuts (falling back to bisection when
+// one side stops moving) and the search ends once the best cut is within
+// sizeTolerance of the target, no cut is left in between, or maxProbes is
+// used up.
+template <class Measure>
+ThresholdSearch searchThreshold(const ErrorCachedTree& cache, long long targetSize, const Measure& measure,
+                                int maxProbes = 16, double sizeTolerance = 0.01) {
+    vector<FixedError> values = cache.breakpoints();
+    const long long n = static_cast<long long>(values.size());
+    auto thresholdAt = [&](long long p) {
+        return p < n ? values[p] : (n > 0 ? values.back() + 1 : 0);
+    };
+    ThresholdSearch search;
+    auto probe = [&](long long p) {
+        search.probes++;
+        return measure(thresholdAt(p));
+    };
 
-    node->avgColor = calculateAverageColor(image, x, y, width, height);
+    long long lo = 0, hi = n;
+    long long sizeHi = probe(hi);
+    if (sizeHi > targetSize || n == 0) {
+        search.threshold = thresholdAt(hi);
+        search.size = sizeHi;
+        search.reached = sizeHi <= targetSize;
+        return search;
+    }
+    long long sizeLo = probe(lo);
+    if (sizeLo <= targetSize) {
+        hi = lo;
+        sizeHi = sizeLo;
+    }
 
-    double error = 0.0;
-    if (errorMethod == 1) {
-        error = calculateErrorVariance(image, x, y, width, height, node->avgColor);
-    } else if (errorMethod == 2) { 
-        error = calculateErrorMAD(image, x, y, width, height, node->avgColor);
-    } else if (errorMethod == 3) {
-        error = calculateErrorMaxDiff(image, x, y, width, height);
-    } else if (errorMethod == 4) {
-        error = calculateEntropy(image, x, y, width, height);
-    } else if (errorMethod == 5) {
-        error = calculateSSIM(image, x, y, width, height, node->avgColor);
-    } else {
-        printWarning("Metode error tidak valid!");
-        error = 0;
+    int sameSide = 0;  // > 0: hi moved last, < 0: lo moved last
+    while (hi > lo && search.probes < maxProbes &&
+           sizeHi < targetSize * (1.0 - sizeTolerance)) {
+        long long p;
+        if (abs(sameSide) >= 2 || sizeLo <= sizeHi) {
+            p = lo + (hi - lo) / 2;
+            sameSide = 0;
+        } else {
+            double fraction = static_cast<double>(sizeLo - targetSize) / static_cast<double>(sizeLo - sizeHi);
+            p = lo + static_cast<long long>(fraction * static_cast<double>(hi - lo));
+        }
+        // Snap to the first position of a breakpoint strictly inside (lo, hi).
+        p = lower_bound(values.begin(), values.end(), values[max(p, lo)]) - values.begin();
+        if (p <= lo) {
+            p = upper_bound(values.begin(), values.end(), values[lo]) - values.begin();
+        }
+        if (p >= hi) {
+            break;
+        }
+        long long size = probe(p);
+        if (size <= targetSize) {
+            hi = p;
+            sizeHi = size;
+            sameSide = sameSide > 0 ? sameSide + 1 : 1;
+        } else {
+            lo = p;
+            sizeLo = size;
+            sameSide = sameSide < 0 ? sameSide - 1 : -1;
+        }
     }
+    search.threshold = thresholdAt(hi);
+    search.size = sizeHi;
+    search.reached = true;
+    return search;
+}
 
+// How a compression run turns block statistics into an output image.
+struct BuildSettings {
+    string layout = "tree";      // tree, linear or stream
+    string traversal = "depth";  // depth or breadth (tree layout only)
+    long long maxNodes = 0;      // > 0 selects the best-first builder (tree layout only)
+    bool errorCache = false;     // build the full tree once and cut it (tree layout only)
+    FixedError threshold = 0;
+    int minBlockSize = 1;
+    int threadCount = 1;
+    long long taskCutoff = 65536;
+};
 
-    int nextWidth = width / 2;
-    int nextHeight = height / 2;
-    bool subBlocksTooSmall = (nextWidth == 0 || nextHeight == 0);
+// Representations a run keeps after drawing, for the caller to reuse.
+struct BuildOutputs {
+    LinearQuadtree linear;  // --layout=linear
+    ErrorCachedTree cache;  // --error-cache
+};
 
+// Builds the chosen representation and draws it into outputImage. The
+// linear layout and the error cache are kept in outputs for the caller; the
+// stream layout keeps nothing but the recursion path and draws leaves as
+// they are decided.
+template <class Metric>
+BuildCounters compressImage(const ImageStatistics& stats, const BuildSettings& settings,
+                            CImg<unsigned char>& outputImage, BuildOutputs& outputs) {
+    int width = outputImage.width(), height = outputImage.height();
+    BuildCounters counters;
+    if (settings.layout == "stream") {
+        RasterLeafSink sink{outputImage};
+        return runBuild(settings.threadCount, settings.taskCutoff, [&](BuildWorker& worker, ParallelBuild* parallel) {
+            buildLeaves<Metric>(stats, sink, 0, 0, 0, width, height, settings.threshold, settings.minBlockSize, 0,
+                                worker, parallel);
+        });
+    }
+    if (settings.layout == "linear") {
+        buildLinearQuadtree<Metric>(stats, outputs.linear, width, height, settings.threshold, settings.minBlockSize,
+                                    settings.threadCount, settings.taskCutoff, counters);
+        reconstructImage(outputImage, outputs.linear);
+        return counters;
+    }
+    if (settings.errorCache) {
+        outputs.cache.build<Metric>(stats, width, height, settings.minBlockSize);
+        return outputs.cache.draw(outputImage, settings.threshold);
+    }
 
-    if (error < threshold || (width * height) <= minBlockSize || subBlocksTooSmall ) {
-        node->isLeaf = true;
+    Quadtree tree;
+    if (settings.maxNodes > 0) {
+        buildQuadtreeBestFirst<Metric>(stats, tree, width, height, settings.threshold, settings.minBlockSize,
+                                       settings.maxNodes, counters);
+    } else if (settings.traversal == "breadth") {
+        buildQuadtreeBreadthFirst<Metric>(stats, tree, width, height, settings.threshold, settings.minBlockSize,
+                                          settings.threadCount, counters);
     } else {
-        node->isLeaf = false;
-
-        int w1 = nextWidth;
-        int h1 = nextHeight;
-        int w2 = width - w1;
-        int h2 = height - h1;
-
-        if (w1 > 0 && h1 > 0)
-            node->children[0] = buildQuadtree(image, x, y, w1, h1, threshold, minBlockSize, currentDepth + 1, errorMethod); // NW
-        if (w2 > 0 && h1 > 0)
-            node->children[1] = buildQuadtree(image, x + w1, y, w2, h1, threshold, minBlockSize, currentDepth + 1, errorMethod); // NE
-        if (w1 > 0 && h2 > 0)
-            node->children[2] = buildQuadtree(image, x, y + h1, w1, h2, threshold, minBlockSize, currentDepth + 1, errorMethod); // SW
-        if (w2 > 0 && h2 > 0)
-            node->children[3] = buildQuadtree(image, x + w1, y + h1, w2, h2, threshold, minBlockSize, currentDepth + 1, errorMethod); // SE
+        buildQuadtree<Metric>(stats, tree, width, height, settings.threshold, settings.minBlockSize,
+                              settings.threadCount, settings.taskCutoff, counters);
     }
-
-    return node;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(settings.threadCount)
+#pragma omp single
+#endif
+    reconstructImage(outputImage, tree, settings.taskCutoff);
+    return counters;
 }
 
-void reconstructImage(CImg<unsigned char>& outputImage, const QuadtreeNode* node) {
-    if (node == nullptr) {
-        return;
+// compressImage with the metric of an error method choice (1-5).
+BuildCounters compressWithMethod(int errorMethod, const ImageStatistics& stats, const BuildSettings& settings,
+                                 CImg<unsigned char>& outputImage, BuildOutputs& outputs) {
+    switch (errorMethod) {
+        case 1: return compressImage<VarianceMetric>(stats, settings, outputImage, outputs);
+        case 2: return compressImage<MADMetric>(stats, settings, outputImage, outputs);
+        case 3: return compressImage<MaxDiffMetric>(stats, settings, outputImage, outputs);
+        case 4: return compressImage<EntropyMetric>(stats, settings, outputImage, outputs);
+        default: return compressImage<SSIMMetric>(stats, settings, outputImage, outputs);
     }
+}
 
-    if (node->isLeaf) {
-        unsigned char color[3];
-        color[0] = static_cast<unsigned char>(max(0.0, min(255.0, node->avgColor.r)));
-        color[1] = static_cast<unsigned char>(max(0.0, min(255.0, node->avgColor.g)));
-        color[2] = static_cast<unsigned char>(max(0.0, min(255.0, node->avgColor.b)));
+// One configuration of a parameter sweep and what it produced.
+struct SweepRow {
+    int errorMethod = 1;
+    double threshold = 0.0;
+    int minBlockSize = 1;
+    BuildCounters counters;
+    long long pngBytes = 0;   // estimatePngSize of the reconstruction
+    double buildMs = 0.0;     // build and reconstruction
+    double sizeMs = 0.0;      // size estimate
+};
 
-        // CImg draw_rectangle(x0, y0, x1, y1, color, opacity)
-        outputImage.draw_rectangle(node->x, node->y,
-                                   node->x + node->width - 1, node->y + node->height - 1,
-                                   color, 1.0f);
-    } else {
-        for (int i = 0; i < 4; ++i) {
-            reconstructImage(outputImage, node->children[i]);
+// Runs every method x threshold x minimum block size combination on one
+// image. Statistics are built once per method, down to the smallest block
+// size of the grid (a deeper pyramid holds the same block results), and
+// Variance and SSIM share one integral image unless the pyramid builder is
+// chosen. Configurations run in parallel, each on one thread, and the rows
+// come back in grid order.
+vector<SweepRow> runSweep(const CImg<unsigned char>& image, const vector<int>& methods,
+                          const vector<double>& thresholds, const vector<int>& minBlockSizes,
+                          bool usePyramid, int threadCount, double& statsMs) {
+    auto statsStart = chrono::high_resolution_clock::now();
+    const int smallestBlock = *min_element(minBlockSizes.begin(), minBlockSizes.end());
+    ImageStatistics statsByMethod[6];
+    const ImageStatistics* statsFor[6] = {};
+    for (int method : methods) {
+        int owner = (!usePyramid && method == 5) ? 1 : method;
+        if (!statsFor[owner]) {
+            statsByMethod[owner].build(image, method, smallestBlock, usePyramid, threadCount);
+            statsFor[owner] = &statsByMethod[owner];
+        }
+        statsFor[method] = statsFor[owner];
+    }
+    statsMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - statsStart).count();
+
+    vector<SweepRow> rows;
+    for (int method : methods) {
+        for (double threshold : thresholds) {
+            for (int minBlockSize : minBlockSizes) {
+                SweepRow row;
+                row.errorMethod = method;
+                row.threshold = threshold;
+                row.minBlockSize = minBlockSize;
+                rows.push_back(row);
+            }
         }
     }
+
+    auto runRow = [&](SweepRow& row) {
+        auto start = chrono::high_resolution_clock::now();
+        CImg<unsigned char> outputImage(image.width(), image.height(), 1, 3, 0);
+        BuildSettings settings;
+        settings.threshold = thresholdToFixed(row.threshold);
+        settings.minBlockSize = row.minBlockSize;
+        settings.threadCount = 1;
+        BuildOutputs outputs;
+        row.counters = compressWithMethod(row.errorMethod, *statsFor[row.errorMethod], settings, outputImage, outputs);
+        auto built = chrono::high_resolution_clock::now();
+        row.pngBytes = estimatePngSize(outputImage);
+        row.buildMs = chrono::duration<double, milli>(built - start).count();
+        row.sizeMs = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - built).count();
+    };
+    const long long count = static_cast<long long>(rows.size());
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(threadCount) schedule(dynamic)
+    for (long long i = 0; i < count; ++i) {
+        runRow(rows[i]);
+    }
+#else
+    WorkStealingPool pool(threadCount);
+    for (long long i = 0; i < count; ++i) {
+        pool.submit([&runRow, &rows, i] { runRow(rows[i]); });
+    }
+    pool.wait();
+#endif
+    return rows;
 }
 
+// Parses a comma-separated list of numbers, e.g. "10,20.5,40".
+vector<double> parseNumberList(const string& text) {
+    vector<double> values;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        if (end == string::npos) end = text.size();
+        size_t used = 0;
+        string item = text.substr(start, end - start);
+        values.push_back(stod(item, &used));
+        if (used != item.size()) {
+            throw invalid_argument(item);
+        }
+        start = end + 1;
+    }
+    return values;
+}
 
-int main() {
+int main(int argc, char* argv[]) {
     string inputFile, outputFile = "test/default.png";
+    string builder = "recursive";
+#ifdef _OPENMP
+    int threadCount = omp_get_max_threads();
+#else
+    int threadCount = max(1u, thread::hardware_concurrency());
+#endif
+    long long taskCutoff = 65536;
+    string layout = "tree";
+    string traversal = "depth";
+    long long maxNodes = 0, maxBytes = 0, targetLeaves = 0;
+    string leavesFile;
+    vector<double> queryPoint;
+    bool errorCache = false; // asked for with --error-cache: re-cut interactively
+    bool buildCache = false; // also forced by the modes that cut the cached tree
+    double targetCompression = 0.0, targetPsnr = 0.0;
+    bool estimateSize = false;
+    string sweepFile, curveFile;
+    vector<int> sweepMethods = {1, 2, 3, 4, 5}, sweepMinBlocks = {1};
+    vector<double> sweepThresholds;
     string errorStr = "";
     int errorMethodChoice;
     double threshold, maxThreshold;
     int minBlockSize;
     CImg<unsigned char> inputImage;
 
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--builder=", 0) == 0) {
+            builder = arg.substr(10);
+            if (builder != "recursive" && builder != "pyramid") {
+                printWarning("Error: Builder harus recursive atau pyramid.");
+                return 1;
+            }
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            try {
+                threadCount = stoi(arg.substr(10));
+            } catch (const exception&) {
+                threadCount = 0;
+            }
+            if (threadCount < 1) {
+                printWarning("Error: Jumlah thread harus 1 atau lebih besar.");
+                return 1;
+            }
+        } else if (arg.rfind("--task-cutoff=", 0) == 0) {
+            try {
+                taskCutoff = stoll(arg.substr(14));
+            } catch (const exception&) {
+                taskCutoff = 0;
+            }
+            if (taskCutoff < 1) {
+                printWarning("Error: Batas luas task harus 1 atau lebih besar.");
+                return 1;
+            }
+        } else if (arg.rfind("--layout=", 0) == 0) {
+            layout = arg.substr(9);
+            if (layout != "tree" && layout != "linear" && layout != "stream") {
+                printWarning("Error: Layout harus tree, linear atau stream.");
+                return 1;
+            }
+        } else if (arg.rfind("--traversal=", 0) == 0) {
+            traversal = arg.substr(12);
+            if (traversal != "depth" && traversal != "breadth") {
+                printWarning("Error: Traversal harus depth atau breadth.");
+                return 1;
+            }
+        } else if (arg.rfind("--target-leaves=", 0) == 0) {
+            try {
+                targetLeaves = stoll(arg.substr(16));
+            } catch (const exception&) {
+                targetLeaves = 0;
+            }
+            if (targetLeaves < 1) {
+                printWarning("Error: Target jumlah daun harus 1 atau lebih besar.");
+                return 1;
+            }
+        } else if (arg.rfind("--max-nodes=", 0) == 0 || arg.rfind("--max-bytes=", 0) == 0) {
+            long long value = 0;
+            try {
+                value = stoll(arg.substr(12));
+            } catch (const exception&) {
+                value = 0;
+            }
+            if (value < 1) {
+                printWarning("Error: Anggaran simpul/byte harus 1 atau lebih besar.");
+                return 1;
+            }
+            if (arg.rfind("--max-nodes=", 0) == 0) {
+                maxNodes = value;
+            } else {
+                maxBytes = value;
+            }
+        } else if (arg.rfind("--target-compression=", 0) == 0) {
+            try {
+                targetCompression = stod(arg.substr(21));
+            } catch (const exception&) {
+                targetCompression = 0.0;
+            }
+            if (!(targetCompression > 0.0 && targetCompression < 100.0)) {
+                printWarning("Error: Target persentase kompresi harus di antara 0 dan 100.");
+                return 1;
+            }
+        } else if (arg.rfind("--target-psnr=", 0) == 0) {
+            try {
+                targetPsnr = stod(arg.substr(14));
+            } catch (const exception&) {
+                targetPsnr = 0.0;
+            }
+            if (!(targetPsnr > 0.0)) {
+                printWarning("Error: Target PSNR harus lebih besar dari 0 dB.");
+                return 1;
+            }
+        } else if (arg.rfind("--rd-curve=", 0) == 0) {
+            curveFile = arg.substr(11);
+        } else if (arg.rfind("--sweep=", 0) == 0) {
+            sweepFile = arg.substr(8);
+        } else if (arg.rfind("--methods=", 0) == 0 || arg.rfind("--thresholds=", 0) == 0 ||
+                   arg.rfind("--min-blocks=", 0) == 0) {
+            size_t eq = arg.find('=');
+            string name = arg.substr(0, eq);
+            vector<double> values;
+            try {
+                values = parseNumberList(arg.substr(eq + 1));
+            } catch (const exception&) {
+                printWarning("Error: " + name + " harus berupa daftar angka dipisah koma.");
+                return 1;
+            }
+            if (name == "--thresholds") {
+                if (*min_element(values.begin(), values.end()) < 0.0) {
+                    printWarning("Error: Threshold tidak boleh negatif.");
+                    return 1;
+                }
+                sweepThresholds = values;
+                continue;
+            }
+            vector<int>& target = name == "--methods" ? sweepMethods : sweepMinBlocks;
+            target.clear();
+            for (double value : values) {
+                bool valid = value == floor(value) && value >= 1 && (name != "--methods" || value <= 5);
+                if (!valid) {
+                    printWarning(name == "--methods" ? "Error: Pilihan metoda harus antara 1 hingga 5 (inklusif)."
+                                                     : "Error: Ukuran blok minimum harus 1 atau lebih besar.");
+                    return 1;
+                }
+                target.push_back(static_cast<int>(value));
+            }
+        } else if (arg == "--estimate-size") {
+            estimateSize = true;
+        } else if (arg == "--error-cache") {
+            errorCache = true;
+        } else if (arg.rfind("--leaves=", 0) == 0) {
+            leavesFile = arg.substr(9);
+        } else if (arg.rfind("--query=", 0) == 0) {
+            try {
+                queryPoint = parseNumberList(arg.substr(8));
+            } catch (const exception&) {
+                queryPoint.clear();
+            }
+            bool valid = queryPoint.size() == 2;
+            for (double value : queryPoint) {
+                valid = valid && value == floor(value) && value >= 0;
+            }
+            if (!valid) {
+                printWarning("Error: --query harus berupa dua koordinat piksel X,Y.");
+                return 1;
+            }
+        } else {
+            printWarning("Error: Argumen tidak dikenali: " + arg);
+            return 1;
+        }
+    }
+
+    if (!queryPoint.empty() && layout != "linear") {
+        printWarning("Error: --query hanya tersedia untuk --layout=linear.");
+        return 1;
+    }
+    if (traversal == "breadth" && layout != "tree") {
+        printWarning("Error: --traversal=breadth hanya tersedia untuk --layout=tree.");
+        return 1;
+    }
+    if (targetLeaves > 0) {
+        if (maxNodes > 0 || maxBytes > 0) {
+            printWarning("Error: --target-leaves tidak dapat digabung dengan --max-nodes/--max-bytes.");
+            return 1;
+        }
+        maxNodes = nodesForLeaves(targetLeaves);
+    }
+    if (maxBytes > 0) {
+        long long byteNodes = max(1LL, nodesForBytes(maxBytes));
+        maxNodes = maxNodes > 0 ? min(maxNodes, byteNodes) : byteNodes;
+    }
+    if (maxNodes > 0 && (layout != "tree" || traversal != "depth")) {
+        printWarning("Error: --max-nodes/--max-bytes hanya tersedia untuk --layout=tree --traversal=depth.");
+        return 1;
+    }
+    if (targetCompression > 0.0) {
+        if (targetLeaves > 0 || maxNodes > 0) {
+            printWarning("Error: --target-compression tidak dapat digabung dengan --target-leaves/--max-nodes/--max-bytes.");
+            return 1;
+        }
+        // Every probe is a cut through the cached tree.
+        buildCache = true;
+    }
+    if (!curveFile.empty() || targetPsnr > 0.0) {
+        if (targetLeaves > 0 || maxNodes > 0 || targetCompression > 0.0) {
+            printWarning("Error: --rd-curve/--target-psnr tidak dapat digabung dengan target atau anggaran lain.");
+            return 1;
+        }
+        // Both prune the full cached tree.
+        buildCache = true;
+    }
+    buildCache = buildCache || errorCache;
+    if (buildCache && (layout != "tree" || traversal != "depth" || maxNodes > 0)) {
+        printWarning("Error: --error-cache hanya tersedia untuk --layout=tree --traversal=depth tanpa anggaran.");
+        return 1;
+    }
+
+    if (!sweepFile.empty()) {
+        if (sweepThresholds.empty()) {
+            printWarning("Error: --sweep memerlukan --thresholds.");
+            return 1;
+        }
+        if (layout != "tree" || traversal != "depth" || maxNodes > 0 || buildCache) {
+            printWarning("Error: --sweep hanya tersedia untuk --layout=tree --traversal=depth tanpa target/anggaran.");
+            return 1;
+        }
+    }
+
+#ifdef _OPENMP
+    // Also caps the OpenMP loops inside CImg.
+    omp_set_num_threads(threadCount);
+#endif
+
     cout << endl;
     printLine("========== Kompresi Gambar Quadtree ==========");
     cout << "\033[1;32m  ▓╟ Current Working Directory: " << std::filesystem::current_path() << "\033[0m\n";
@@ -384,6 +2830,36 @@ int main() {
     }
     long long inputSize = getFileSizeStream(inputFile);
 
+    // The sweep answers every prompt from its grid.
+    if (!sweepFile.empty()) {
+        printLine("Memulai sweep " + to_string(sweepMethods.size() * sweepThresholds.size() * sweepMinBlocks.size()) +
+                  " konfigurasi...");
+        double statsMs = 0.0;
+        auto sweepStart = chrono::high_resolution_clock::now();
+        vector<SweepRow> rows = runSweep(inputImage, sweepMethods, sweepThresholds, sweepMinBlocks,
+                                         builder == "pyramid", threadCount, statsMs);
+        chrono::duration<double, milli> sweepDuration = chrono::high_resolution_clock::now() - sweepStart;
+
+        ofstream csv(sweepFile);
+        csv << "method,threshold,min_block_size,png_bytes,nodes,max_depth,build_ms,size_ms\n";
+        for (const SweepRow& row : rows) {
+            csv << row.errorMethod << ',' << row.threshold << ',' << row.minBlockSize << ',' << row.pngBytes << ','
+                << row.counters.nodeCount << ',' << row.counters.maxDepth << ',' << row.buildMs << ','
+                << row.sizeMs << '\n';
+        }
+        if (!csv) {
+            printWarning("Tidak dapat menulis file CSV: " + sweepFile);
+            return 1;
+        }
+        printLine("--- Statistik ---");
+        printLine("File CSV               : " + sweepFile + " (" + to_string(rows.size()) + " baris)");
+        printLine("Waktu eksekusi         : " + to_string(sweepDuration.count()) + " ms");
+        printLine("Waktu statistik        : " + to_string(statsMs) + " ms");
+        printLine("Ukuran sebelum         : " + to_string(inputSize) + " bytes");
+        cout << endl;
+        return 0;
+    }
+
     while (true) {
         printCommand("Pilih metode error (1=Variance, 2=MAD, 3=MaxDiff, 4=Entropy, 5=SSIM)");
         cin >> errorMethodChoice;
@@ -425,7 +2901,15 @@ int main() {
             break;
     }
 
-    while (true) {
+    // With a leaf target every splittable block is a candidate, worst first;
+    // a compression or PSNR target searches the threshold itself, and a
+    // curve covers every threshold, starting from the full tree.
+    const bool thresholdPrompt = targetLeaves == 0 && targetCompression == 0.0 && targetPsnr == 0.0 &&
+                                 curveFile.empty();
+    if (!thresholdPrompt) {
+        threshold = 0.0;
+    }
+    while (thresholdPrompt) {
         printCommand("Masukkan nilai threshold untuk " + errorStr +
                     " (rentang efektif: 0.0 - " + to_string(maxThreshold) + ")");
         cin >> threshold;
@@ -468,6 +2952,11 @@ int main() {
     cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
     printCommand("Masukkan path gambar output");
     getline(cin, outputFile);
+    size_t dotPos = outputFile.find_last_of(".");
+    if (dotPos == string::npos) {
+        outputFile += ".png";
+        printWarning("Ekstensi file output tidak dispesifikasi. Menyimpan sebagai PNG.");
+    }
 
     // --- Process ---
     cout << "\n";
@@ -477,37 +2966,149 @@ int main() {
         
         auto startTime = chrono::high_resolution_clock::now();
         
-        nodeCount = 0;
-        maxDepth = 0;
-        
-        QuadtreeNode* root = buildQuadtree(inputImage, 0, 0, inputImage.width(), inputImage.height(),
-        threshold, minBlockSize, 0, errorMethodChoice);
-        
-        reconstructImage(outputImage, root);
+        ImageStatistics stats;
+        stats.build(inputImage, errorMethodChoice, minBlockSize, builder == "pyramid", threadCount);
+        chrono::duration<double, milli> statsDuration = chrono::high_resolution_clock::now() - startTime;
+
+        FixedError fixedThreshold = thresholdToFixed(threshold);
+        BuildCounters counters;
+        BuildSettings settings;
+        settings.layout = layout;
+        settings.traversal = traversal;
+        settings.maxNodes = maxNodes;
+        settings.errorCache = buildCache;
+        settings.threshold = fixedThreshold;
+        settings.minBlockSize = minBlockSize;
+        settings.threadCount = threadCount;
+        settings.taskCutoff = taskCutoff;
+
+        BuildOutputs outputs;
+        counters = compressWithMethod(errorMethodChoice, stats, settings, outputImage, outputs);
+
+        vector<RatePoint> curve;
+        chrono::duration<double, milli> curveDuration{0};
+        if (!curveFile.empty() || targetPsnr > 0.0) {
+            auto curveStart = chrono::high_resolution_clock::now();
+            outputs.cache.measureSquaredErrors(inputImage);
+            curve = rateDistortionCurve(outputs.cache);
+            curveDuration = chrono::high_resolution_clock::now() - curveStart;
+        }
+        if (!curveFile.empty()) {
+            ofstream csv(curveFile);
+            csv << setprecision(12) << "threshold,leaves,nodes,leaf_bytes,mse,psnr\n";
+            for (const RatePoint& point : curve) {
+                double mse = meanSquaredError(point.squaredError, inputImage.width(), inputImage.height());
+                csv << fixedToThreshold(point.threshold) << ',' << point.leaves << ',' << point.nodes << ','
+                    << LinearQuadtree::serializedSize(point.leaves) << ',' << mse << ',' << psnrFromMSE(mse) << '\n';
+            }
+            if (!csv) {
+                printWarning("Tidak dapat menulis file kurva: " + curveFile);
+            }
+        }
+
+        // The coarsest cut whose squared error stays within the PSNR budget,
+        // read off the curve; only that cut is drawn.
+        const RatePoint* psnrPoint = nullptr;
+        bool psnrReached = false;
+        if (targetPsnr > 0.0) {
+            double maxSquaredError = 3.0 * inputImage.width() * inputImage.height() * 255.0 * 255.0 /
+                                     pow(10.0, targetPsnr / 10.0);
+            psnrPoint = &curve.front();
+            for (const RatePoint& point : curve) {
+                if (static_cast<double>(point.squaredError) <= maxSquaredError) {
+                    psnrPoint = &point;
+                    psnrReached = true;
+                }
+            }
+            counters = outputs.cache.draw(outputImage, psnrPoint->threshold);
+            threshold = fixedToThreshold(psnrPoint->threshold);
+        }
+
+        ThresholdSearch search;
+        chrono::duration<double, milli> searchDuration{0};
+        if (targetCompression > 0.0) {
+            if (inputSize <= 0) {
+                throw runtime_error("ukuran file input tidak diketahui");
+            }
+            auto searchStart = chrono::high_resolution_clock::now();
+            long long targetSize = llround(inputSize * (1.0 - targetCompression / 100.0));
+            search = searchThreshold(outputs.cache, targetSize, [&](FixedError probeThreshold) {
+                outputs.cache.draw(outputImage, probeThreshold);
+                if (estimateSize) {
+                    return estimatePngSize(outputImage);
+                }
+                outputImage.save(outputFile.c_str());
+                return getFileSizeStream(outputFile);
+            });
+            counters = outputs.cache.draw(outputImage, search.threshold);
+            threshold = fixedToThreshold(search.threshold);
+            searchDuration = chrono::high_resolution_clock::now() - searchStart;
+        }
         
         auto endTime = chrono::high_resolution_clock::now();
         chrono::duration<double, milli> duration = endTime - startTime;
         printLine("Kompresi Selesai.");
         
         printLine("Menyimpan file gambar...");
-        size_t dotPos = outputFile.find_last_of(".");
-        if (dotPos == string::npos) {
-            outputFile += ".png";
-            printWarning("Ekstensi file output tidak dispesifikasi. Menyimpan sebagai PNG.");
+        long long estimatedSize = -1;
+        chrono::duration<double, milli> estimateDuration{0};
+        if (estimateSize) {
+            auto estimateStart = chrono::high_resolution_clock::now();
+            estimatedSize = estimatePngSize(outputImage);
+            estimateDuration = chrono::high_resolution_clock::now() - estimateStart;
         }
         outputImage.save(outputFile.c_str());
         printLine("Gambar tersimpan.");
 
+        long long leavesSize = -1;
+        if (layout == "linear" && !leavesFile.empty()) {
+            vector<unsigned char> bytes = outputs.linear.serialize();
+            ofstream leavesStream(leavesFile, ios::binary);
+            leavesStream.write(reinterpret_cast<const char*>(bytes.data()), static_cast<streamsize>(bytes.size()));
+            if (leavesStream) {
+                leavesSize = static_cast<long long>(bytes.size());
+            } else {
+                printWarning("Tidak dapat menulis file daun: " + leavesFile);
+            }
+        }
+
         printLine("");
         
         // --- Statistik ---
         printLine("--- Statistik ---");
         printLine("Path gambar output     : " + outputFile);
         printLine("Waktu eksekusi         : " + to_string(duration.count()) + " ms");
+        printLine("Waktu statistik        : " + to_string(statsDuration.count()) + " ms");
         
         printLine("Resolusi Gambar        : " + to_string(inputImage.width()) + "x" + to_string(inputImage.height()));
 
         printLine("Metode error           : " + errorStr);
+        printLine("Builder                : " + builder);
+        printLine("Layout                 : " + layout);
+        printLine("Traversal              : " + traversal);
+        if (targetLeaves > 0) {
+            printLine("Target daun            : " + to_string(targetLeaves));
+        } else if (maxNodes > 0) {
+            printLine("Anggaran simpul        : " + to_string(maxNodes) + " (best-first)");
+        }
+        printLine("Kernel piksel          : " + string(pixelKernels.name()));
+#ifdef _OPENMP
+        printLine("Thread                 : " + to_string(threadCount) + " (OpenMP)");
+#else
+        printLine("Thread                 : " + to_string(threadCount));
+#endif
+        if (targetCompression > 0.0) {
+            printLine("Target kompresi        : " + to_string(targetCompression) + " %" +
+                      (search.reached ? "" : " (tidak tercapai)"));
+            printLine("Probe pencarian        : " + to_string(search.probes) + " (" +
+                      to_string(searchDuration.count()) + " ms)");
+        }
+        if (psnrPoint) {
+            double mse = meanSquaredError(psnrPoint->squaredError, inputImage.width(), inputImage.height());
+            printLine("Target PSNR            : " + to_string(targetPsnr) + " dB" +
+                      (psnrReached ? "" : " (tidak tercapai)"));
+            printLine("PSNR                   : " + to_string(psnrFromMSE(mse)) + " dB (MSE " + to_string(mse) + ")");
+        }
         printLine("Threshold              : " + to_string(threshold));
         printLine("Blok Minimum           : " + to_string(minBlockSize));
         printLine("Ukuran sebelum         : " + to_string(inputSize / (1024.0 * 1024.0)) + " MiB (" + 
@@ -531,12 +3132,101 @@ int main() {
         } else {
             printWarning("Tidak dapat membaca ukuran file output.");
         }
+        if (estimatedSize >= 0) {
+            printEstimate(estimatedSize, outputSize, estimateDuration.count());
+        }
 
-        printLine("Kedalaman pohon maks   : " + to_string(maxDepth));
-        printLine("Jumlah simpul total    : " + to_string(nodeCount));
+        printLine("Kedalaman pohon maks   : " + to_string(counters.maxDepth));
+        printLine("Jumlah simpul total    : " + to_string(counters.nodeCount));
+        if (targetLeaves > 0) {
+            // 1 + 3 leaves per split, and every split adds 4 nodes.
+            printLine("Jumlah daun            : " + to_string(1 + (counters.nodeCount - 1) / 4 * 3));
+        }
+        if (layout == "linear") {
+            printLine("Jumlah daun (linear)   : " + to_string(outputs.linear.leaves.size()));
+            if (leavesSize >= 0) {
+                printLine("File daun              : " + leavesFile + " (" + to_string(leavesSize) + " bytes)");
+            }
+            if (!queryPoint.empty()) {
+                int px = static_cast<int>(min(queryPoint[0], 1e9));
+                int py = static_cast<int>(min(queryPoint[1], 1e9));
+                string point = "(" + to_string(px) + ", " + to_string(py) + ")";
+                const LinearLeaf* leaf = outputs.linear.leafAt(px, py);
+                if (leaf) {
+                    int bx, by, bw, bh;
+                    outputs.linear.blockOf(*leaf, bx, by, bw, bh);
+                    printLine("Daun di " + point + string(max(0, 15 - static_cast<int>(point.size())), ' ') +
+                              ": blok (" + to_string(bx) + ", " + to_string(by) + ") " + to_string(bw) + "x" +
+                              to_string(bh) + ", level " + to_string(leaf->level) + ", warna (" +
+                              to_string(leaf->color[0]) + ", " + to_string(leaf->color[1]) + ", " +
+                              to_string(leaf->color[2]) + ")");
+                } else {
+                    printWarning("Titik " + point + " berada di luar gambar.");
+                }
+            }
+        }
+        if (!curveFile.empty()) {
+            printLine("Kurva RD               : " + curveFile + " (" + to_string(curve.size()) + " titik, " +
+                      to_string(curveDuration.count()) + " ms)");
+        }
+        if (buildCache) {
+            size_t cacheBytes = outputs.cache.nodes.size() * (sizeof(QuadtreeNode) + sizeof(FixedError)) +
+                                outputs.cache.squaredErrors.size() * sizeof(uint64_t);
+            printLine("Cache error            : " + to_string(outputs.cache.nodes.size()) + " simpul (" +
+                      to_string(cacheBytes / (1024.0 * 1024.0)) + " MiB)");
+        }
         cout << endl;
 
-        delete root;
+        // Every further threshold is a cut through the cached tree. Only an
+        // explicit --error-cache asks for more; the modes that merely use the
+        // cache finish here, so batch runs don't wait on stdin.
+        while (errorCache) {
+            printCommand("Masukkan threshold baru (kosong untuk selesai)");
+            string line;
+            if (!getline(cin, line) || line.empty()) {
+                break;
+            }
+            double nextThreshold;
+            try {
+                nextThreshold = stod(line);
+            } catch (const exception&) {
+                printWarning("Error: Masukan harus berupa angka.");
+                continue;
+            }
+            if (nextThreshold < 0.0) {
+                printWarning("Error: Threshold tidak boleh negatif.");
+                continue;
+            }
+
+            auto cutStart = chrono::high_resolution_clock::now();
+            BuildCounters cut = outputs.cache.draw(outputImage, thresholdToFixed(nextThreshold));
+            chrono::duration<double, milli> cutDuration = chrono::high_resolution_clock::now() - cutStart;
+            long long cutEstimate = -1;
+            chrono::duration<double, milli> cutEstimateDuration{0};
+            if (estimateSize) {
+                auto estimateStart = chrono::high_resolution_clock::now();
+                cutEstimate = estimatePngSize(outputImage);
+                cutEstimateDuration = chrono::high_resolution_clock::now() - estimateStart;
+            }
+            outputImage.save(outputFile.c_str());
+
+            printLine("Threshold              : " + to_string(nextThreshold));
+            printLine("Waktu potong           : " + to_string(cutDuration.count()) + " ms");
+            long long cutSize = getFileSizeStream(outputFile);
+            if (cutSize >= 0) {
+                printLine("Ukuran sesudah         : " + to_string(cutSize) + " bytes");
+                if (inputSize > 0) {
+                    double cutRatio = static_cast<double>(cutSize) / inputSize;
+                    printLine("Persentase kompresi    : " + to_string((1.0 - cutRatio) * 100.0) + " %");
+                }
+            }
+            if (cutEstimate >= 0) {
+                printEstimate(cutEstimate, cutSize, cutEstimateDuration.count());
+            }
+            printLine("Kedalaman pohon maks   : " + to_string(cut.maxDepth));
+            printLine("Jumlah simpul total    : " + to_string(cut.nodeCount));
+            cout << endl;
+        }
 
     } catch (CImgException &e) {
         printWarning("Error CImg: " + std::string(e.what()));